@@ -0,0 +1,224 @@
+"""
+Benchmarks of the native kernels and of SIES.fit and SIES.update.
+
+Run with pytest-benchmark, e.g.
+
+    pytest benchmarks/ --benchmark-autosave
+    pytest benchmarks/ --benchmark-compare --benchmark-compare-fail=mean:50%
+
+By default the shapes are small enough for CI. Set IES_BENCHMARK_SHAPES=full
+to sweep up to a million observations and 2000 realizations; shapes whose
+(nobs x ensemble_size) matrices would exceed IES_BENCHMARK_MAX_BYTES (4 GB by
+default) are skipped.
+
+Each benchmark records in extra_info the throughput in observations (or
+parameters) times realizations per second, the peak resident set size of
+one call run in a new interpreter, and the time of each stage of the native
+kernels, see iterative_ensemble_smoother.profiling.
+
+The benchmarks also run against older versions, e.g. the base of a pull
+request in CI, so features that are newer than the baseline are optional.
+"""
+import inspect
+import multiprocessing
+import os
+import sys
+
+import numpy as np
+import pytest
+
+import iterative_ensemble_smoother as ies
+from iterative_ensemble_smoother._ies import create_coefficient_matrix
+
+try:
+    from iterative_ensemble_smoother._ies import ErrorCovariance
+except ImportError:  # Versions without structured error covariances
+    ErrorCovariance = None
+
+try:
+    from iterative_ensemble_smoother.profiling import profile
+except ImportError:  # Versions without profiling
+    profile = None
+
+HAS_IN_PLACE_UPDATE = "in_place" in inspect.signature(ies.SIES.update).parameters
+
+FULL = os.environ.get("IES_BENCHMARK_SHAPES", "ci") == "full"
+MAX_BYTES = int(os.environ.get("IES_BENCHMARK_MAX_BYTES", 4 * 2**30))
+
+NUM_OBS = [1_000, 10_000, 100_000, 1_000_000] if FULL else [1_000, 10_000]
+ENSEMBLE_SIZES = [50, 100, 500, 2000] if FULL else [50, 200]
+NUM_PARAMS = [10_000, 100_000, 1_000_000] if FULL else [10_000, 100_000]
+INVERSIONS = [
+    (ies.InversionType.EXACT, 1.0),
+    (ies.InversionType.EXACT_R, 0.98),
+    (ies.InversionType.EXACT_R, 1.0),
+    (ies.InversionType.SUBSPACE_RE, 0.98),
+    (ies.InversionType.SUBSPACE_RE, 1.0),
+]
+
+
+def skip_if_too_large(rows, ensemble_size):
+    # The responses, Y, E, D, S and H are all (rows x ensemble_size)
+    if 6 * 8 * rows * ensemble_size > MAX_BYTES:
+        pytest.skip("exceeds IES_BENCHMARK_MAX_BYTES")
+
+
+def _run_and_measure(case, args):
+    """Runs the function made by case(*args) once and returns the peak
+    resident set size of the process in bytes."""
+    import resource
+
+    case(*args)()
+    # ru_maxrss is in kilobytes on Linux and in bytes on macOS
+    usage = resource.getrusage(resource.RUSAGE_SELF)
+    return usage.ru_maxrss * (1 if sys.platform == "darwin" else 1024)
+
+
+def peak_rss_bytes(case, args):
+    """The peak resident set size of a new interpreter making the function of
+    case(*args) and running it once, or None where it is not available.
+
+    The interpreter is spawned rather than forked, since the OpenMP runtime
+    of the parent does not survive a fork."""
+    if sys.platform == "win32":
+        return None
+    with multiprocessing.get_context("spawn").Pool(1) as pool:
+        peak_rss: int = pool.apply(_run_and_measure, (case, args))
+    return peak_rss
+
+
+def record(benchmark, function, items, case, args):
+    """Record throughput, peak RSS and the stages of one call of function,
+    which is made by case(*args)."""
+    benchmark.extra_info["items_per_second"] = items / benchmark.stats.stats.mean
+    benchmark.extra_info["peak_rss_bytes"] = peak_rss_bytes(case, args)
+    if profile is None:
+        return
+    with profile() as p:
+        function()
+    benchmark.extra_info["stages"] = {
+        name: stage["seconds"] for name, stage in p.stages().items()
+    }
+
+
+def create_coefficient_matrix_case(num_obs, ensemble_size, inversion, truncation):
+    rng = np.random.default_rng(42)
+    Y = rng.normal(size=(num_obs, ensemble_size))
+    E = rng.normal(size=(num_obs, ensemble_size))
+    D = rng.normal(size=(num_obs, ensemble_size))
+    W = np.zeros((ensemble_size, ensemble_size))
+    R = None if ErrorCovariance is None else ErrorCovariance.identity(num_obs)
+
+    def function():
+        return create_coefficient_matrix(Y, R, E, D, inversion, truncation, W, 0.6)
+
+    return function
+
+
+def sies_fit_case(num_obs, ensemble_size, inversion, truncation):
+    rng = np.random.default_rng(42)
+    responses = rng.normal(size=(num_obs, ensemble_size))
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    observation_values = rng.normal(size=num_obs)
+    noise = rng.normal(size=(num_obs, ensemble_size))
+
+    def function():
+        ies.SIES(ensemble_size).fit(
+            responses,
+            observation_errors,
+            observation_values,
+            noise=noise,
+            inversion=inversion,
+            truncation=truncation,
+        )
+
+    return function
+
+
+def sies_update_case(num_params, ensemble_size, in_place):
+    """The update of given parameters, and the parameters."""
+    rng = np.random.default_rng(42)
+    num_obs = 100
+    smoother = ies.SIES(ensemble_size)
+    smoother.fit(
+        rng.normal(size=(num_obs, ensemble_size)),
+        np.ones(num_obs),
+        np.zeros(num_obs),
+    )
+    params = rng.normal(size=(num_params, ensemble_size))
+
+    def function(params=params):
+        if in_place:
+            return smoother.update(params, in_place=True)
+        return smoother.update(params)
+
+    return function, params
+
+
+def sies_update_copy_case(num_params, ensemble_size, in_place):
+    """The update of a new copy of the parameters."""
+    function, params = sies_update_case(num_params, ensemble_size, in_place)
+    return lambda: function(params.copy())
+
+
+@pytest.fixture(scope="module")
+def rng():
+    return np.random.default_rng(42)
+
+
+@pytest.mark.parametrize("num_obs", NUM_OBS)
+@pytest.mark.parametrize("ensemble_size", ENSEMBLE_SIZES)
+@pytest.mark.parametrize("inversion, truncation", INVERSIONS)
+def test_create_coefficient_matrix(
+    benchmark, num_obs, ensemble_size, inversion, truncation
+):
+    skip_if_too_large(num_obs, ensemble_size)
+    if ErrorCovariance is None and inversion == ies.InversionType.EXACT_R:
+        pytest.skip("R would be dense without ErrorCovariance")
+    args = (num_obs, ensemble_size, inversion, truncation)
+    function = create_coefficient_matrix_case(*args)
+
+    benchmark(function)
+    record(
+        benchmark,
+        function,
+        num_obs * ensemble_size,
+        create_coefficient_matrix_case,
+        args,
+    )
+
+
+@pytest.mark.parametrize("num_obs", NUM_OBS)
+@pytest.mark.parametrize("ensemble_size", ENSEMBLE_SIZES)
+@pytest.mark.parametrize("inversion, truncation", INVERSIONS)
+def test_sies_fit(benchmark, num_obs, ensemble_size, inversion, truncation):
+    skip_if_too_large(num_obs, ensemble_size)
+    args = (num_obs, ensemble_size, inversion, truncation)
+    function = sies_fit_case(*args)
+
+    benchmark(function)
+    record(benchmark, function, num_obs * ensemble_size, sies_fit_case, args)
+
+
+@pytest.mark.parametrize("num_params", NUM_PARAMS)
+@pytest.mark.parametrize("ensemble_size", ENSEMBLE_SIZES)
+@pytest.mark.parametrize("in_place", [False, True])
+def test_sies_update(benchmark, num_params, ensemble_size, in_place):
+    skip_if_too_large(num_params, ensemble_size)
+    if in_place and not HAS_IN_PLACE_UPDATE:
+        pytest.skip("SIES.update has no in_place")
+    args = (num_params, ensemble_size, in_place)
+    function, params = sies_update_case(*args)
+
+    if in_place:
+        # Each round updates a fresh copy of the parameters
+        benchmark.pedantic(function, setup=lambda: ((params.copy(),), {}), rounds=10)
+    else:
+        benchmark(function)
+    record(
+        benchmark,
+        lambda: function(params.copy()),
+        num_params * ensemble_size,
+        sies_update_copy_case,
+        args,
+    )
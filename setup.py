@@ -1,4 +1,6 @@
-from glob import glob
+import os
+import platform
+import sys
 from os import path
 from pathlib import Path
 from subprocess import check_output
@@ -8,15 +10,150 @@ from setuptools import setup
 
 check_output(["conan", "install", "."])
 
+
+def openmp_args():
+    """Compiler and linker flags for OpenMP, which lets Eigen run its kernels
+    multithreaded. Enabled by default on Linux, set IES_USE_OPENMP=0 or 1 to
+    override."""
+    default = "1" if sys.platform.startswith("linux") else "0"
+    if os.environ.get("IES_USE_OPENMP", default) != "1":
+        return [], []
+    if sys.platform == "win32":
+        return ["/openmp"], []
+    return ["-fopenmp"], ["-fopenmp"]
+
+
+def blas_args():
+    """Macros and libraries for running the Eigen kernels on a vendor BLAS and
+    LAPACK, selected with IES_BLAS:
+
+    - eigen (default): Eigen's built-in kernels,
+    - openblas: OpenBLAS through EIGEN_USE_BLAS and EIGEN_USE_LAPACKE,
+    - lapacke: any BLAS/LAPACKE pair, e.g. the reference implementation,
+    - mkl: Intel MKL through EIGEN_USE_MKL_ALL, found through MKLROOT.
+
+    IES_BLAS_LIBRARIES, IES_BLAS_LIBRARY_DIRS and IES_BLAS_INCLUDE_DIRS
+    (separated by os.pathsep) override the defaults of the chosen backend."""
+    backend = os.environ.get("IES_BLAS", "eigen")
+    include_dirs = []
+    library_dirs = []
+    if backend == "eigen":
+        return backend, [], [], [], []
+    elif backend == "openblas":
+        macros = [("EIGEN_USE_BLAS", None), ("EIGEN_USE_LAPACKE", None)]
+        libraries = ["openblas"]
+    elif backend == "lapacke":
+        macros = [("EIGEN_USE_BLAS", None), ("EIGEN_USE_LAPACKE", None)]
+        libraries = ["lapacke", "lapack", "blas"]
+    elif backend == "mkl":
+        macros = [("EIGEN_USE_MKL_ALL", None)]
+        libraries = ["mkl_rt"]
+        mklroot = os.environ.get("MKLROOT")
+        if mklroot:
+            include_dirs = [path.join(mklroot, "include")]
+            library_dirs = [path.join(mklroot, "lib", "intel64")]
+    else:
+        raise ValueError(
+            f"Unknown IES_BLAS backend {backend!r}, "
+            "expected one of eigen, openblas, lapacke or mkl"
+        )
+
+    def from_environment(name, default):
+        value = os.environ.get(name)
+        return value.split(os.pathsep) if value else default
+
+    return (
+        backend,
+        macros,
+        from_environment("IES_BLAS_LIBRARIES", libraries),
+        from_environment("IES_BLAS_LIBRARY_DIRS", library_dirs),
+        from_environment("IES_BLAS_INCLUDE_DIRS", include_dirs),
+    )
+
+
+def simd_variants():
+    """The instruction set flags of each build of _ies. All builds go into the
+    same wheel, and the best one the CPU supports is loaded at import time, see
+    _ies.py. Set IES_SIMD_VARIANTS to a comma separated subset to build fewer,
+    e.g. IES_SIMD_VARIANTS=avx2. The baseline is always built. Only x86-64 has
+    other variants, the baseline of aarch64 already uses NEON."""
+    if platform.machine().lower() not in ("x86_64", "amd64"):
+        variants = {"baseline": []}
+    elif sys.platform == "win32":
+        variants = {
+            "baseline": [],
+            "avx2": ["/arch:AVX2"],
+            "avx512": ["/arch:AVX512"],
+        }
+    else:
+        variants = {
+            "baseline": [],
+            "sse4": ["-msse4.2"],
+            "avx2": ["-mavx2", "-mfma"],
+            "avx512": [
+                "-mavx512f",
+                "-mavx512dq",
+                "-mavx512bw",
+                "-mavx512vl",
+                "-mavx2",
+                "-mfma",
+            ],
+        }
+
+    selected = os.environ.get("IES_SIMD_VARIANTS")
+    if not selected:
+        return variants
+    names = {name.strip() for name in selected.split(",")}
+    unknown = names - set(variants)
+    if unknown:
+        raise ValueError(
+            f"Unknown IES_SIMD_VARIANTS {sorted(unknown)}, "
+            f"expected a subset of {sorted(variants)}"
+        )
+    return {
+        name: flags
+        for name, flags in variants.items()
+        if name in names or name == "baseline"
+    }
+
+
+openmp_compile_args, openmp_link_args = openmp_args()
+(
+    blas_backend,
+    blas_macros,
+    blas_libraries,
+    blas_library_dirs,
+    blas_include_dirs,
+) = blas_args()
+
 ext_modules = [
     Pybind11Extension(
-        "iterative_ensemble_smoother._ies",
-        sorted(glob("src/iterative_ensemble_smoother/*.cpp")),
+        f"iterative_ensemble_smoother._ies_{variant}",
+        ["src/iterative_ensemble_smoother/ies.cpp"],
         cxx_std=17,
         include_dirs=[
             path.join(path.dirname(__file__), "src/iterative_ensemble_smoother/"),
-        ],
-        extra_compile_args=Path("conanbuildinfo.args").read_text().split(),
+        ]
+        + blas_include_dirs,
+        define_macros=[
+            ("IES_BLAS_BACKEND", f'"{blas_backend}"'),
+            ("IES_MODULE_NAME", f"_ies_{variant}"),
+            ("IES_SIMD_VARIANT", f'"{variant}"'),
+        ]
+        + blas_macros,
+        libraries=blas_libraries,
+        library_dirs=blas_library_dirs,
+        extra_compile_args=Path("conanbuildinfo.args").read_text().split()
+        + openmp_compile_args
+        + simd_flags,
+        extra_link_args=openmp_link_args,
+    )
+    for variant, simd_flags in simd_variants().items()
+] + [
+    Pybind11Extension(
+        "iterative_ensemble_smoother._cpu_features",
+        ["src/iterative_ensemble_smoother/cpu_features.cpp"],
+        cxx_std=17,
     ),
 ]
 
@@ -4,7 +4,7 @@ for Data Assimilation and Reservoir History Matching"
 https://www.frontiersin.org/articles/10.3389/fams.2019.00047/full
 """
 
-from ._ies import InversionType
+from ._ies import ErrorCovariance, InversionType, SolverOptions, SVDEngine
 from ._iterative_ensemble_smoother import (
     ES,
     SIES,
@@ -13,5 +13,8 @@ from ._iterative_ensemble_smoother import (
 __all__ = [
     "ES",
     "SIES",
+    "ErrorCovariance",
     "InversionType",
+    "SolverOptions",
+    "SVDEngine",
 ]
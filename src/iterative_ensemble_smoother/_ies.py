@@ -0,0 +1,47 @@
+"""
+The native module, built once per SIMD instruction set, see setup.py.
+
+At import time the best build the CPU supports is loaded, e.g. ``_ies_avx2``,
+and its functions and classes are available from this module. Set IES_SIMD to
+the name of a variant, e.g. ``baseline``, to load that one instead.
+``simd_variant`` is the variant in use and ``simd_instruction_sets`` the
+instruction sets Eigen was compiled for.
+"""
+from __future__ import annotations
+
+import importlib
+import os
+from types import ModuleType
+from typing import Any, List
+
+from ._cpu_features import supported_simd_variants
+
+
+def _load_variant() -> ModuleType:
+    supported: List[str] = supported_simd_variants()
+    requested = os.environ.get("IES_SIMD")
+    if requested:
+        if requested not in supported:
+            raise ImportError(
+                f"IES_SIMD={requested!r} is not supported by this CPU, "
+                f"expected one of {supported}"
+            )
+        return importlib.import_module(f"{__package__}._ies_{requested}")
+    for variant in supported:
+        try:
+            return importlib.import_module(f"{__package__}._ies_{variant}")
+        except ModuleNotFoundError:
+            # Not built, see IES_SIMD_VARIANTS in setup.py
+            continue
+    raise ImportError("No variant of the native module _ies is installed")
+
+
+_native = _load_variant()
+
+
+def __getattr__(name: str) -> Any:
+    return getattr(_native, name)
+
+
+def __dir__() -> List[str]:
+    return sorted(set(globals()) | set(dir(_native)))
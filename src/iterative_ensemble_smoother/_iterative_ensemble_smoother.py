@@ -1,5 +1,17 @@
 from __future__ import annotations
-from typing import Optional, TYPE_CHECKING
+from collections import deque
+from concurrent.futures import Future, ThreadPoolExecutor
+from typing import (
+    Any,
+    Callable,
+    Deque,
+    Iterable,
+    List,
+    Optional,
+    Tuple,
+    Union,
+    TYPE_CHECKING,
+)
 
 import numpy as np
 
@@ -8,27 +20,25 @@ if TYPE_CHECKING:
 
 rng = np.random.default_rng()
 
-from ._ies import InversionType, make_D, create_coefficient_matrix
+from ._ies import (
+    CoefficientMatrixFactors,
+    ErrorCovariance,
+    GramAccumulator,
+    InversionType,
+    SIESState,
+    SolverOptions,
+    apply_transition_matrix,
+    ensemble_smoother_sweep,
+    make_E_D,
+    make_Y_E_D,
+)
 from iterative_ensemble_smoother.utils import (
     _validate_inputs,
     _create_errors,
+    _observation_covariance,
 )
 
 
-def _response_projection(
-    param_ensemble: npt.NDArray[np.double],
-) -> npt.NDArray[np.double]:
-    """A^+A projection is necessary when the parameter matrix has fewer rows than
-    columns, and when the forward model is non-linear. Section 2.4.3
-    """
-    ensemble_size = param_ensemble.shape[1]
-    A = (param_ensemble - param_ensemble.mean(axis=1, keepdims=True)) / np.sqrt(
-        ensemble_size - 1
-    )
-    projection: npt.NDArray[np.double] = np.linalg.pinv(A) @ A
-    return projection
-
-
 class SIES:
     """SIES performs the update step of the Subspace Iterative Ensemble Smoother
     algorithm. See `Evensen[1]`_.
@@ -37,6 +47,8 @@ class SIES:
     :param max_steplength: parameter used to tweaking the step length.
     :param min_steplength: parameter used to tweaking the step length.
     :param dec_steplength: parameter used to tweaking the step length.
+    :param options: Options of the native solver, e.g. the factorization of
+        the exact inversion and the SVD engine of the subspace inversions.
     """
 
     def __init__(
@@ -46,13 +58,38 @@ class SIES:
         max_steplength: float = 0.6,
         min_steplength: float = 0.3,
         dec_steplength: float = 2.5,
+        options: Optional[SolverOptions] = None,
     ):
         self._initial_ensemble_size = ensemble_size
         self.iteration_nr = 1
         self.max_steplength = max_steplength
         self.min_steplength = min_steplength
         self.dec_steplength = dec_steplength
-        self.coefficient_matrix = np.zeros(shape=(ensemble_size, ensemble_size))
+        self._state = SIESState(ensemble_size, options or SolverOptions())
+        self._executor: Optional[ThreadPoolExecutor] = None
+
+    @property
+    def options(self) -> SolverOptions:
+        """The options of the native solver, used by the next fit. Changing
+        a field of the returned options changes them in place."""
+        options: SolverOptions = self._state.options
+        return options
+
+    @options.setter
+    def options(self, options: SolverOptions) -> None:
+        self._state.options = options
+
+    @property
+    def coefficient_matrix(self) -> npt.NDArray[np.double]:
+        """The coefficient matrix W of the initial ensemble, Eq. (42)."""
+        W: npt.NDArray[np.double] = self._state.coefficient_matrix
+        return W
+
+    @property
+    def ensemble_mask(self) -> npt.NDArray[np.bool_]:
+        """The realizations that were active in the last call to fit."""
+        mask: npt.NDArray[np.bool_] = self._state.ensemble_mask
+        return mask
 
     def _get_steplength(self, iteration_nr: int) -> float:
         """
@@ -70,7 +107,7 @@ class SIES:
     def fit(
         self,
         response_ensemble: npt.NDArray[np.double],
-        observation_errors: npt.NDArray[np.double],
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
         observation_values: npt.NDArray[np.double],
         *,
         noise: Optional[npt.NDArray[np.double]] = None,
@@ -84,10 +121,15 @@ class SIES:
 
         :param response_ensemble: Matrix of responses from the :term:`forward model`.
             Has shape (number of observations, number of realizations).
-            (Y in Evensen et. al)
+            (Y in Evensen et. al). If it is float32, the products with the
+            observations are computed in single precision.
         :param observation_errors: 1D array of measurement errors (standard deviations)
                                    for each observation, or covariance matrix
-                                   if errors are correlated.
+                                   if errors are correlated. Correlated errors
+                                   may also be given as an ``ErrorCovariance``,
+                                   e.g. ``ErrorCovariance.low_rank(variances,
+                                   factor)`` for diag(variances) + factor @
+                                   factor.T, which is never formed densely.
         :param observation_values: 1D array of observations.
         :param noise: Optional noise matrix with the same shape as response matrix.
             Elements should be sampled independently from a standard normal.
@@ -115,74 +157,389 @@ class SIES:
             param_ensemble=param_ensemble,
         )
 
-        num_obs = len(observation_values)
-        ensemble_size = response_ensemble.shape[1]
         if step_length is None:
             step_length = self._get_steplength(self.iteration_nr)
 
-        if noise is None:
-            noise = rng.standard_normal(size=(num_obs, ensemble_size))
-
-        # Columns of E should be sampled from N(0,Cdd) and centered, Evensen 2019
-        if len(observation_errors.shape) == 2:
-            E = np.linalg.cholesky(observation_errors) @ noise
-        else:
-            E = np.linalg.cholesky(np.diag(observation_errors**2)) @ noise
-        E = E @ (
-            np.identity(ensemble_size)
-            - np.ones((ensemble_size, ensemble_size)) / ensemble_size
+        R, E, D, Y = self._scaled_observations(
+            response_ensemble,
+            observation_errors,
+            observation_values,
+            noise,
+            inversion,
         )
+        self._set_param_ensemble(param_ensemble)
+        self._state.fit(Y, R, E, D, inversion, truncation, step_length, ensemble_mask)
 
-        R, observation_errors = _create_errors(observation_errors, inversion)
-
-        D = make_D(observation_values, E, response_ensemble)
+        self.iteration_nr += 1
 
-        # Scale D and E with observation error standard deviations.
-        D = (D.T / observation_errors).T
-        E = (E.T / observation_errors).T
+    def fit_blocks(
+        self,
+        blocks: Iterable[Tuple[npt.NDArray[np.double], ...]],
+        *,
+        step_length: Optional[float] = None,
+        ensemble_mask: Optional[npt.NDArray[np.bool_]] = None,
+    ) -> None:
+        """Perform one step of the iterative ensemble smoother algorithm with
+        the exact inversion, with the observations given one block at a time.
+
+        Only N x N products of each block are kept, so memory does not grow with
+        the number of observations, and a generator may load the next block
+        from disk or a forward model while the previous one is processed. The
+        result equals that of :meth:`fit` with all blocks stacked, up to
+        rounding, when the errors of different blocks are uncorrelated.
+
+        :param blocks: Tuples of ``(response_ensemble, observation_errors,
+            observation_values)`` or ``(response_ensemble, observation_errors,
+            observation_values, noise)`` for each block of observations, as
+            in :meth:`fit`.
+        :param step_length: See :meth:`fit`.
+        :param ensemble_mask: See :meth:`fit`.
+        """
+        if step_length is None:
+            step_length = self._get_steplength(self.iteration_nr)
 
-        if param_ensemble is not None:
-            projected_response = response_ensemble @ _response_projection(
-                param_ensemble
+        gram: Optional[GramAccumulator] = None
+        for block in blocks:
+            response_ensemble, observation_errors, observation_values, *noise = block
+            block_noise = noise[0] if noise else None
+            _validate_inputs(
+                response_ensemble, block_noise, observation_errors, observation_values
             )
-            response_ensemble = (projected_response.T / observation_errors).T
-        else:
-            response_ensemble = (response_ensemble.T / observation_errors).T
+            _, _, D, Y = self._scaled_observations(
+                response_ensemble,
+                observation_errors,
+                observation_values,
+                block_noise,
+                InversionType.EXACT,
+            )
+            if gram is None:
+                gram = GramAccumulator(response_ensemble.shape[1])
+            gram.add(Y, D)
+
+        if gram is None:
+            raise ValueError("blocks must contain at least one block")
+        self._state.fit(gram, step_length, ensemble_mask)
 
-        if ensemble_mask is None:
-            ensemble_mask = np.array([True] * ensemble_size)
+        self.iteration_nr += 1
+
+    def fit_incremental(
+        self,
+        response_ensemble: npt.NDArray[np.double],
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
+        observation_values: npt.NDArray[np.double],
+        *,
+        noise: Optional[npt.NDArray[np.double]] = None,
+        step_length: Optional[float] = None,
+        ensemble_mask: Optional[npt.NDArray[np.bool_]] = None,
+    ) -> None:
+        """Perform one step of the iterative ensemble smoother algorithm with
+        the exact inversion, so that observations appended before the next
+        step can be added to it with :meth:`append_observations`.
+
+        The N x N products of the observations are kept in the native state,
+        as in :meth:`fit_blocks`. See :meth:`fit` for the parameters.
+        """
+        _validate_inputs(
+            response_ensemble, noise, observation_errors, observation_values
+        )
+        if step_length is None:
+            step_length = self._get_steplength(self.iteration_nr)
+
+        _, _, D, Y = self._scaled_observations(
+            response_ensemble,
+            observation_errors,
+            observation_values,
+            noise,
+            InversionType.EXACT,
+        )
+        self._state.fit_incremental(Y, D, step_length, ensemble_mask)
+
+        self.iteration_nr += 1
+
+    def append_observations(
+        self,
+        response_ensemble: npt.NDArray[np.double],
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
+        observation_values: npt.NDArray[np.double],
+        *,
+        noise: Optional[npt.NDArray[np.double]] = None,
+    ) -> None:
+        """Add observations to the last step of :meth:`fit_incremental`, e.g.
+        the data of a new report step that arrived after it.
+
+        Only the new observations are processed, so the cost is proportional
+        to their number rather than to all the observations of the step. The
+        result equals that of :meth:`fit_incremental` with all observations
+        stacked, up to rounding, when the errors of the new observations are
+        uncorrelated with those of the earlier ones. The step length and the
+        active realizations are those of the last step.
+
+        :param response_ensemble: The responses of the new observations of the
+            active realizations.
+        :param observation_errors: See :meth:`fit`.
+        :param observation_values: See :meth:`fit`.
+        :param noise: See :meth:`fit`.
+        """
+        _validate_inputs(
+            response_ensemble, noise, observation_errors, observation_values
+        )
+        _, _, D, Y = self._scaled_observations(
+            response_ensemble,
+            observation_errors,
+            observation_values,
+            noise,
+            InversionType.EXACT,
+        )
+        self._state.append_observations(Y, D)
+
+    def factorize(
+        self,
+        response_ensemble: npt.NDArray[np.double],
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
+        observation_values: npt.NDArray[np.double],
+        *,
+        noise: Optional[npt.NDArray[np.double]] = None,
+        ensemble_mask: Optional[npt.NDArray[np.bool_]] = None,
+        inversion: InversionType = InversionType.EXACT,
+        param_ensemble: Optional[npt.NDArray[np.double]] = None,
+    ) -> CoefficientMatrixFactors:
+        """Factorize the next step, for trying several truncations and step
+        lengths without repeating the work that does not depend on them.
 
-        self.ensemble_mask = ensemble_mask
+        ``factors.coefficient_matrix(truncation, step_length)`` and
+        ``factors.transition_matrix(truncation, step_length)`` give the
+        result of :meth:`fit` with the same arguments, at a cost independent
+        of the number of observations. Pass the chosen values to
+        :meth:`fit_factorized` to perform the step.
 
-        W: npt.NDArray[np.double] = create_coefficient_matrix(
-            (response_ensemble - response_ensemble.mean(axis=1, keepdims=True))
-            / np.sqrt(ensemble_size - 1),
-            R,
-            E,
-            D,
+        See :meth:`fit` for the parameters.
+        """
+        _validate_inputs(
+            response_ensemble,
+            noise,
+            observation_errors,
+            observation_values,
+            param_ensemble=param_ensemble,
+        )
+        R, E, D, Y = self._scaled_observations(
+            response_ensemble,
+            observation_errors,
+            observation_values,
+            noise,
             inversion,
-            truncation,
-            self.coefficient_matrix[ensemble_mask, :][:, ensemble_mask],
-            step_length,
         )
+        self._set_param_ensemble(param_ensemble)
+        factors: CoefficientMatrixFactors = self._state.factorize(
+            Y, R, E, D, inversion, ensemble_mask
+        )
+        return factors
 
-        if np.isnan(W).sum() != 0:
-            raise ValueError(
-                "Fit produces NaNs. Check your response matrix for outliers or use an inversion type with truncation."
-            )
+    def fit_factorized(
+        self,
+        factors: CoefficientMatrixFactors,
+        *,
+        truncation: float = 0.98,
+        step_length: Optional[float] = None,
+    ) -> None:
+        """Perform the step factorized by :meth:`factorize`, with the given
+        truncation and step length. See :meth:`fit`.
+        """
+        if step_length is None:
+            step_length = self._get_steplength(self.iteration_nr)
+        self._state.fit(factors, truncation, step_length)
 
         self.iteration_nr += 1
 
-        self.coefficient_matrix[np.outer(ensemble_mask, ensemble_mask)] = W.ravel()
+    def _set_param_ensemble(
+        self, param_ensemble: Optional[npt.NDArray[np.double]]
+    ) -> None:
+        """Project the responses onto the row space of the parameter anomalies,
+        Section 2.4.3. The projection is cached in the native state and only
+        recomputed when param_ensemble changes."""
+        if param_ensemble is None:
+            self._state.clear_param_ensemble()
+        else:
+            self._state.set_param_ensemble(param_ensemble)
+
+    @staticmethod
+    def _scaled_observations(
+        response_ensemble: npt.NDArray[np.double],
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
+        observation_values: npt.NDArray[np.double],
+        noise: Optional[npt.NDArray[np.double]],
+        inversion: InversionType,
+    ) -> Tuple[
+        Optional[Union[npt.NDArray[np.double], ErrorCovariance]],
+        npt.NDArray[np.double],
+        npt.NDArray[np.double],
+        npt.NDArray[np.double],
+    ]:
+        """R, E, D and the normalized anomalies Y of Algorithm 1, all scaled by
+        the observation error standard deviations."""
+        dtype = np.float32 if response_ensemble.dtype == np.float32 else np.float64
+        response_ensemble = response_ensemble.astype(dtype, copy=False)
+        if noise is not None:
+            noise = noise.astype(dtype, copy=False)
+
+        C = _observation_covariance(observation_errors)
+        R, observation_errors = _create_errors(observation_errors, inversion)
 
-    def update(self, param_ensemble: npt.NDArray[np.double]) -> npt.NDArray[np.double]:
+        # Columns of E are sampled from N(0,Cdd) and centered, Evensen 2019.
+        # Y, E and D are scaled with observation error standard deviations,
+        # in a single pass over the responses.
+        Y, E, D = make_Y_E_D(
+            observation_values,
+            C,
+            response_ensemble,
+            noise=noise,
+            seed=None if noise is not None else int(rng.integers(2**63)),
+            scale=observation_errors,
+        )
+        return R, E, D, Y
+
+    def update(
+        self,
+        param_ensemble: npt.NDArray[np.double],
+        *,
+        in_place: bool = False,
+        block_size: int = 4096,
+    ) -> npt.NDArray[np.double]:
+        """Update the parameters with the coefficient matrix from the last fit.
+
+        :param param_ensemble: Matrix of parameters of the active realizations.
+            Has shape (number of parameters, number of realizations).
+        :param in_place: Overwrite param_ensemble, which must then be a writeable
+            float32 or float64 array such as an ``np.memmap``, instead of
+            allocating the result. The update is done in parallel over blocks of
+            rows.
+        :param block_size: Number of rows per block when updating in place.
+        """
         # Line 9 of Algorithm 1
-        ensemble_size = self.ensemble_mask.sum()
-        I = np.identity(ensemble_size)
-        W = self.coefficient_matrix[self.ensemble_mask, :][:, self.ensemble_mask]
-        transition_matrix: npt.NDArray[np.double] = I + W / np.sqrt(ensemble_size - 1)
+        transition_matrix: npt.NDArray[np.double] = self._state.transition_matrix()
+        if in_place:
+            apply_transition_matrix(param_ensemble, transition_matrix, block_size)
+            return param_ensemble
+        if param_ensemble.dtype == np.float32:
+            return param_ensemble @ transition_matrix.astype(np.float32)
         return param_ensemble @ transition_matrix
 
+    def update_blocks(self, param_blocks: Iterable[npt.NDArray[np.double]]) -> None:
+        """Update, in place, parameters supplied one block of rows at a time.
+
+        Only the transition matrix and the current block need to be in
+        memory. A generator can read each block from disk, yield it, and
+        write it back once the generator is resumed::
+
+            def blocks():
+                for start in range(0, num_params, block_size):
+                    block = read(start, start + block_size)
+                    yield block
+                    write(start, block)
+
+            smoother.update_blocks(blocks())
+
+        :param param_blocks: Writeable float32 or float64 arrays of shape
+            (number of rows in block, number of realizations).
+        """
+        transition_matrix = self._state.transition_matrix()
+        for block in param_blocks:
+            apply_transition_matrix(block, transition_matrix)
+
+    def _submit(self, function: Callable[..., Any], *args: Any, **kwargs: Any) -> Any:
+        """Runs function on the thread of this smoother, after the calls
+        submitted before it."""
+        if self._executor is None:
+            self._executor = ThreadPoolExecutor(1, thread_name_prefix="ies")
+        return self._executor.submit(function, *args, **kwargs)
+
+    def fit_async(self, *args: Any, **kwargs: Any) -> Future[None]:
+        """Submit :meth:`fit` with the given arguments to a background thread,
+        e.g. to read the parameters while W is computed. See :meth:`fit`.
+
+        The native kernels release the GIL, so the calling thread keeps
+        running. Calls of :meth:`fit_async`, :meth:`update_async` and
+        :meth:`update_blocks_async` run one at a time in the order they were
+        made. Other methods must not be called before the returned future is
+        done.
+        """
+        future: Future[None] = self._submit(self.fit, *args, **kwargs)
+        return future
+
+    def update_async(
+        self, param_ensemble: npt.NDArray[np.double], **kwargs: Any
+    ) -> Future[npt.NDArray[np.double]]:
+        """Submit :meth:`update` to the thread of :meth:`fit_async`, so it
+        runs once the submitted fits are done. See :meth:`update`."""
+        future: Future[npt.NDArray[np.double]] = self._submit(
+            self.update, param_ensemble, **kwargs
+        )
+        return future
+
+    def update_blocks_async(
+        self,
+        param_blocks: Iterable[npt.NDArray[np.double]],
+        write: Callable[[int, npt.NDArray[np.double]], None],
+        *,
+        max_pending: int = 2,
+    ) -> Future[None]:
+        """Update, in place, parameters read one block of rows at a time, and
+        pass each updated block with its index to ``write``.
+
+        Reading, updating and writing are pipelined: while one block is
+        updated the next one is read, and the previous one is written by
+        another thread, so the update overlaps with the I/O instead of
+        alternating with it::
+
+            blocks = (read(start, start + block_size) for start in starts)
+            future = smoother.update_blocks_async(
+                blocks, lambda i, block: write(starts[i], block)
+            )
+            future.result()
+
+        The pipeline starts once the calls submitted before it are done, see
+        :meth:`fit_async`. The returned future is done when every block is
+        written, and raises the first error of reading, updating or writing.
+
+        :param param_blocks: Writeable float32 or float64 arrays of shape
+            (number of rows in block, number of realizations). Iterated on
+            the thread of :meth:`fit_async`.
+        :param write: Called with the index and the updated block, one block
+            at a time in order.
+        :param max_pending: The maximum number of blocks being updated or
+            written while the next block is read, which bounds the memory
+            used to max_pending + 1 blocks.
+        """
+        if max_pending < 1:
+            raise ValueError("max_pending must be positive")
+
+        def pipeline() -> None:
+            transition_matrix = self._state.transition_matrix()
+            pending: Deque[Future[None]] = deque()
+            with ThreadPoolExecutor(1) as updater, ThreadPoolExecutor(1) as writer:
+
+                def update_and_write(
+                    index: int,
+                    block: npt.NDArray[np.double],
+                    updated: Future[None],
+                ) -> None:
+                    updated.result()
+                    write(index, block)
+
+                for index, block in enumerate(param_blocks):
+                    while len(pending) >= max_pending:
+                        pending.popleft().result()
+                    updated = updater.submit(
+                        apply_transition_matrix, block, transition_matrix
+                    )
+                    pending.append(
+                        writer.submit(update_and_write, index, block, updated)
+                    )
+            for future in pending:
+                future.result()
+
+        future: Future[None] = self._submit(pipeline)
+        return future
+
     def __repr__(self) -> str:
         return (
             f"SIES(ensemble_size={self._initial_ensemble_size}, "
@@ -198,7 +555,7 @@ class ES:
     def fit(
         self,
         response_ensemble: npt.NDArray[np.double],
-        observation_errors: npt.NDArray[np.double],
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
         observation_values: npt.NDArray[np.double],
         *,
         noise: Optional[npt.NDArray[np.double]] = None,
@@ -223,5 +580,75 @@ class ES:
         assert self.smoother is not None
         return self.smoother.update(param_ensemble)
 
+    @staticmethod
+    def fit_sweep(
+        response_ensemble: npt.NDArray[np.double],
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
+        observation_values: npt.NDArray[np.double],
+        *,
+        inflations: Iterable[float] = (1.0,),
+        noises: Optional[Iterable[npt.NDArray[np.double]]] = None,
+        truncation: Union[float, int] = 0.98,
+        inversion: InversionType = InversionType.EXACT,
+    ) -> List[npt.NDArray[np.double]]:
+        """The transition matrices of :meth:`fit` on the same responses for
+        several inflations of the observation error covariance or
+        realizations of the noise, e.g. for ES-MDA or for screening weightings
+        of the observations. The parameters of case ``i`` are
+        ``param_ensemble @ transition_matrices[i]``.
+
+        The SVD of the scaled responses is computed once for all cases, and
+        the small solves of the cases run in parallel, see
+        ``ensemble_smoother_sweep``.
+
+        :param inflations: The factor the error covariance is multiplied with
+            in each case. A single inflation is used for all cases.
+        :param noises: Standard normal noise of each case, see
+            :meth:`SIES.fit`. A single noise is used for all cases. Defaults to
+            one draw used for all cases.
+        """
+        noise_list: List[Optional[npt.NDArray[np.double]]] = (
+            [None] if noises is None else list(noises)
+        )
+        if not noise_list:
+            raise ValueError("noises must not be empty")
+        for noise in noise_list:
+            _validate_inputs(
+                response_ensemble, noise, observation_errors, observation_values
+            )
+
+        R, E, D, Y = SIES._scaled_observations(
+            response_ensemble,
+            observation_errors,
+            observation_values,
+            noise_list[0],
+            inversion,
+        )
+        # The innovations without noise are scaled by 1 / sqrt(inflation)
+        D -= E
+        errors = [E]
+        if len(noise_list) > 1:
+            C = _observation_covariance(observation_errors)
+            _, scale = _create_errors(observation_errors, inversion)
+            for noise in noise_list[1:]:
+                assert noise is not None
+                E_noise, _ = make_E_D(
+                    observation_values,
+                    C,
+                    response_ensemble.astype(Y.dtype, copy=False),
+                    noise=noise.astype(Y.dtype, copy=False),
+                    scale=scale,
+                )
+                errors.append(E_noise)
+
+        ensemble_size = response_ensemble.shape[1]
+        coefficient_matrices = ensemble_smoother_sweep(
+            Y, R, D, errors, list(inflations), inversion, truncation
+        )
+        return [
+            np.identity(ensemble_size) + W / np.sqrt(ensemble_size - 1)
+            for W in coefficient_matrices
+        ]
+
     def __repr__(self) -> str:
         return "ES()"
@@ -0,0 +1,99 @@
+/*
+ * Detection of the SIMD instruction sets of the CPU, to choose which build
+ * of _ies to load, see _ies.py. Kept apart from _ies and built without any
+ * instruction set flags, so it can be imported on any CPU before a variant
+ * is chosen.
+ */
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+namespace py = pybind11;
+
+namespace {
+
+struct CPUFeatures {
+  bool sse4_2 = false;
+  bool avx2 = false;
+  bool fma = false;
+  bool avx512f = false;
+  bool avx512dq = false;
+  bool avx512bw = false;
+  bool avx512vl = false;
+};
+
+/**
+ * The instruction sets that both the CPU and the operating system support,
+ * i.e. the OS saves the AVX and AVX-512 registers on context switches.
+ */
+CPUFeatures cpu_features() {
+  CPUFeatures features;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  features.sse4_2 = __builtin_cpu_supports("sse4.2");
+  features.avx2 = __builtin_cpu_supports("avx2");
+  features.fma = __builtin_cpu_supports("fma");
+  features.avx512f = __builtin_cpu_supports("avx512f");
+  features.avx512dq = __builtin_cpu_supports("avx512dq");
+  features.avx512bw = __builtin_cpu_supports("avx512bw");
+  features.avx512vl = __builtin_cpu_supports("avx512vl");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  int info[4];
+  __cpuid(info, 0);
+  const int max_leaf = info[0];
+  __cpuid(info, 1);
+  const auto bit = [&](int reg, int i) {
+    return (static_cast<unsigned>(info[reg]) >> i) & 1u;
+  };
+  features.sse4_2 = bit(2, 20);
+  const bool fma = bit(2, 12);
+  const bool osxsave = bit(2, 27);
+  const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+  /* XMM and YMM state, and for AVX-512 also the opmask and ZMM state */
+  const bool avx_state = (xcr0 & 0x6) == 0x6;
+  const bool avx512_state = (xcr0 & 0xe6) == 0xe6;
+  features.fma = avx_state && fma;
+  if (max_leaf >= 7) {
+    __cpuidex(info, 7, 0);
+    features.avx2 = avx_state && bit(1, 5);
+    features.avx512f = avx512_state && bit(1, 16);
+    features.avx512dq = avx512_state && bit(1, 17);
+    features.avx512bw = avx512_state && bit(1, 30);
+    features.avx512vl = avx512_state && bit(1, 31);
+  }
+#endif
+  return features;
+}
+
+/**
+ * The builds of _ies this CPU can run, best first. The flags of each are
+ * set in setup.py. "baseline" runs everywhere, and on aarch64 already uses
+ * NEON.
+ */
+std::vector<std::string> supported_simd_variants() {
+  const CPUFeatures cpu = cpu_features();
+  std::vector<std::string> variants;
+  if (cpu.avx512f && cpu.avx512dq && cpu.avx512bw && cpu.avx512vl &&
+      cpu.avx2 && cpu.fma)
+    variants.push_back("avx512");
+  if (cpu.avx2 && cpu.fma)
+    variants.push_back("avx2");
+  if (cpu.sse4_2)
+    variants.push_back("sse4");
+  variants.push_back("baseline");
+  return variants;
+}
+
+} // namespace
+
+PYBIND11_MODULE(_cpu_features, m) {
+  m.def("supported_simd_variants", &supported_simd_variants,
+        "The SIMD variants of _ies this CPU can run, best first.");
+}
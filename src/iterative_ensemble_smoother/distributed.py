@@ -0,0 +1,243 @@
+"""
+Subspace iterative ensemble smoother with the observations and parameters
+partitioned by rows across MPI processes.
+
+Each process holds its own rows of the responses, observations and
+parameters, and none holds all of them. The observations of each process are
+compressed to at most ensemble_size rows with a QR factorization, see
+``compress_observations``, and the compressed blocks are combined pairwise in
+a tree reduction, so only (ensemble_size x ensemble_size) matrices are sent.
+Every process then computes the same coefficient matrix, and
+:meth:`SIES.update` updates the local parameters without communication.
+
+The errors of observations on different processes must be uncorrelated.
+Requires `mpi4py <https://mpi4py.readthedocs.io>`_::
+
+    from mpi4py import MPI
+    from iterative_ensemble_smoother import distributed
+
+    smoother = distributed.SIES(ensemble_size, comm=MPI.COMM_WORLD)
+    smoother.fit(local_responses, local_errors, local_observations)
+    local_params = smoother.update(local_params)
+"""
+from __future__ import annotations
+
+import importlib
+from typing import Any, Callable, Optional, Tuple, TypeVar, Union, TYPE_CHECKING
+
+import numpy as np
+
+from ._ies import (
+    CoefficientMatrixFactors,
+    ErrorCovariance,
+    InversionType,
+    compress_observations,
+)
+from ._iterative_ensemble_smoother import SIES as _SIES
+from .utils import _validate_inputs
+
+if TYPE_CHECKING:
+    import numpy.typing as npt
+
+    # Y, R, E and D, as returned by compress_observations
+    Observations = Tuple[
+        npt.NDArray[np.double],
+        Optional[npt.NDArray[np.double]],
+        npt.NDArray[np.double],
+        npt.NDArray[np.double],
+    ]
+
+T = TypeVar("T")
+
+
+def _tree_reduce(comm: Any, value: T, combine: Callable[[T, T], T]) -> T:
+    """Combines the values of all processes pairwise in ceil(log2(size))
+    rounds, in rank order, and returns the result on every process."""
+    rank, size = comm.Get_rank(), comm.Get_size()
+    step = 1
+    while step < size:
+        if rank % (2 * step) == step:
+            comm.send(value, dest=rank - step)
+            break
+        if rank + step < size:
+            value = combine(value, comm.recv(source=rank + step))
+        step *= 2
+    result: T = comm.bcast(value if rank == 0 else None, root=0)
+    return result
+
+
+def _combine_observations(first: Observations, second: Observations) -> Observations:
+    """Compresses two blocks of compressed observations into one."""
+    R: Optional[ErrorCovariance] = None
+    if first[1] is not None and second[1] is not None:
+        R = ErrorCovariance.block_diagonal([first[1], second[1]])
+    compressed: Observations = compress_observations(
+        np.vstack((first[0], second[0])),
+        R,
+        np.vstack((first[2], second[2])),
+        np.vstack((first[3], second[3])),
+    )
+    return compressed
+
+
+def _combine_params(
+    first: npt.NDArray[np.double], second: npt.NDArray[np.double]
+) -> npt.NDArray[np.double]:
+    """The triangular factor of two stacked triangular factors."""
+    triangular: npt.NDArray[np.double] = np.linalg.qr(
+        np.vstack((first, second)), mode="r"
+    )
+    return triangular
+
+
+class SIES(_SIES):
+    """SIES with the observations and parameters partitioned across MPI
+    processes. See :class:`iterative_ensemble_smoother.SIES`.
+
+    All processes must call :meth:`fit` and :meth:`factorize` together, with
+    their own rows of the responses, observation errors, observation values,
+    noise and parameters, and the same remaining arguments. Observation
+    errors given as a covariance matrix are the covariance of the local
+    observations.
+
+    :param ensemble_size: The number of realizations in the ensemble model.
+    :param comm: The MPI communicator of the processes. Defaults to
+        ``MPI.COMM_WORLD``.
+    """
+
+    def __init__(
+        self,
+        ensemble_size: int,
+        *,
+        max_steplength: float = 0.6,
+        min_steplength: float = 0.3,
+        dec_steplength: float = 2.5,
+        comm: Optional[Any] = None,
+    ):
+        super().__init__(
+            ensemble_size,
+            max_steplength=max_steplength,
+            min_steplength=min_steplength,
+            dec_steplength=dec_steplength,
+        )
+        if comm is None:
+            try:
+                comm = importlib.import_module("mpi4py.MPI").COMM_WORLD
+            except ImportError as err:
+                raise ImportError(
+                    "The distributed smoother requires mpi4py, "
+                    "see https://mpi4py.readthedocs.io"
+                ) from err
+        self.comm: Any = comm
+
+    def fit(
+        self,
+        response_ensemble: npt.NDArray[np.double],
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
+        observation_values: npt.NDArray[np.double],
+        *,
+        noise: Optional[npt.NDArray[np.double]] = None,
+        truncation: Union[float, int] = 0.98,
+        step_length: Optional[float] = None,
+        ensemble_mask: Optional[npt.NDArray[np.bool_]] = None,
+        inversion: InversionType = InversionType.EXACT,
+        param_ensemble: Optional[npt.NDArray[np.double]] = None,
+    ) -> None:
+        """Perform one step of the iterative ensemble smoother algorithm, see
+        :meth:`iterative_ensemble_smoother.SIES.fit`. The arrays are the rows
+        of this process."""
+        if step_length is None:
+            step_length = self._get_steplength(self.iteration_nr)
+        Y, R, E, D = self._reduced_observations(
+            response_ensemble,
+            observation_errors,
+            observation_values,
+            noise,
+            inversion,
+            param_ensemble,
+        )
+        self._state.fit(Y, R, E, D, inversion, truncation, step_length, ensemble_mask)
+
+        self.iteration_nr += 1
+
+    def fit_blocks(self, *args: Any, **kwargs: Any) -> None:
+        """Not supported, the observations are already partitioned across
+        processes. Use :meth:`fit`."""
+        raise NotImplementedError(
+            "fit_blocks is not supported by the distributed smoother, use fit"
+        )
+
+    def factorize(
+        self,
+        response_ensemble: npt.NDArray[np.double],
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
+        observation_values: npt.NDArray[np.double],
+        *,
+        noise: Optional[npt.NDArray[np.double]] = None,
+        ensemble_mask: Optional[npt.NDArray[np.bool_]] = None,
+        inversion: InversionType = InversionType.EXACT,
+        param_ensemble: Optional[npt.NDArray[np.double]] = None,
+    ) -> CoefficientMatrixFactors:
+        """Factorize the next step, see
+        :meth:`iterative_ensemble_smoother.SIES.factorize`. The arrays are the
+        rows of this process, and every process gets the same factors."""
+        Y, R, E, D = self._reduced_observations(
+            response_ensemble,
+            observation_errors,
+            observation_values,
+            noise,
+            inversion,
+            param_ensemble,
+        )
+        factors: CoefficientMatrixFactors = self._state.factorize(
+            Y, R, E, D, inversion, ensemble_mask
+        )
+        return factors
+
+    def _reduced_observations(
+        self,
+        response_ensemble: npt.NDArray[np.double],
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
+        observation_values: npt.NDArray[np.double],
+        noise: Optional[npt.NDArray[np.double]],
+        inversion: InversionType,
+        param_ensemble: Optional[npt.NDArray[np.double]],
+    ) -> Observations:
+        """Y, R, E and D of the observations of all processes, compressed to
+        at most ensemble_size rows. Also sets the parameter ensemble of the
+        response projection from the parameters of all processes."""
+        _validate_inputs(
+            response_ensemble,
+            noise,
+            observation_errors,
+            observation_values,
+            param_ensemble=param_ensemble,
+        )
+        R, E, D, Y = self._scaled_observations(
+            response_ensemble,
+            observation_errors,
+            observation_values,
+            noise,
+            inversion,
+        )
+        local: Observations = compress_observations(Y, R, E, D)
+        observations = _tree_reduce(self.comm, local, _combine_observations)
+
+        # The projection only depends on the row space of the parameters,
+        # which is that of their triangular factor.
+        if param_ensemble is not None:
+            param_ensemble = _tree_reduce(
+                self.comm,
+                np.linalg.qr(param_ensemble, mode="r"),
+                _combine_params,
+            )
+        self._set_param_ensemble(param_ensemble)
+        return observations
+
+    def __repr__(self) -> str:
+        return (
+            f"distributed.SIES(ensemble_size={self._initial_ensemble_size}, "
+            f"max_steplength={self.max_steplength}, "
+            f"min_steplength={self.min_steplength}, "
+            f"dec_steplength={self.dec_steplength})"
+        )
@@ -8,9 +8,15 @@ rng = np.random.default_rng()
 
 from iterative_ensemble_smoother.utils import (
     _create_errors,
+    _observation_covariance,
 )
 
-from ._ies import InversionType, make_D, create_coefficient_matrix
+from ._ies import (
+    InversionType,
+    apply_row_scaling,
+    create_coefficient_matrix,
+    make_Y_E_D,
+)
 
 
 def ensemble_smoother_update_step_row_scaling(
@@ -22,41 +28,43 @@ def ensemble_smoother_update_step_row_scaling(
     truncation=0.98,
     inversion=InversionType.EXACT,
 ):
-    """This is an experimental feature."""
+    """This is an experimental feature.
+
+    Each row_scale is either an object with a ``multiply(A, transition_matrix)``
+    method that updates A in place, or a 1D array with one scaling factor per
+    row of A, in which case A must be a writeable float32 or float64 array.
+    """
     ensemble_size = response_ensemble.shape[1]
-    if noise is None:
-        num_obs = len(observation_values)
-        noise = rng.standard_normal(size=(num_obs, ensemble_size))
-
-    # Columns of E should be sampled from N(0,Cdd) and centered, Evensen 2019
-    if len(observation_errors.shape) == 2:
-        E = np.linalg.cholesky(observation_errors) @ noise
-    else:
-        E = np.linalg.cholesky(np.diag(observation_errors**2)) @ noise
-    E = E @ (
-        np.identity(ensemble_size)
-        - np.ones((ensemble_size, ensemble_size)) / ensemble_size
-    )
 
+    C = _observation_covariance(observation_errors)
     R, observation_errors = _create_errors(observation_errors, inversion)
 
-    D = make_D(observation_values, E, response_ensemble)
-    D = (D.T / observation_errors).T
-    E = (E.T / observation_errors).T
-    response_ensemble = (response_ensemble.T / observation_errors).T
+    # Columns of E are sampled from N(0,Cdd) and centered, Evensen 2019
+    Y, E, D = make_Y_E_D(
+        observation_values,
+        C,
+        response_ensemble,
+        noise=noise,
+        seed=None if noise is not None else int(rng.integers(2**63)),
+        scale=observation_errors,
+    )
+
+    # W does not depend on A, so it is computed once for all groups
+    W = create_coefficient_matrix(
+        Y,
+        R,
+        E,
+        D,
+        inversion,
+        truncation,
+        np.zeros((ensemble_size, ensemble_size)),
+        1.0,
+    )
+    I = np.identity(ensemble_size)
+    transition_matrix = I + W / np.sqrt(ensemble_size - 1)
     for A, row_scale in A_with_row_scaling:
-        W = create_coefficient_matrix(
-            (response_ensemble - response_ensemble.mean(axis=1, keepdims=True))
-            / np.sqrt(ensemble_size - 1),
-            R,
-            E,
-            D,
-            inversion,
-            truncation,
-            np.zeros((ensemble_size, ensemble_size)),
-            1.0,
-        )
-        I = np.identity(ensemble_size)
-        transition_matrix = I + W / np.sqrt(ensemble_size - 1)
-        row_scale.multiply(A, transition_matrix)
+        if isinstance(row_scale, np.ndarray):
+            apply_row_scaling(A, row_scale, W)
+        else:
+            row_scale.multiply(A, transition_matrix)
     return A_with_row_scaling
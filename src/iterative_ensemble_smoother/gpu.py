@@ -0,0 +1,299 @@
+"""
+Subspace iterative ensemble smoother on a GPU.
+
+The algorithm is that of :class:`iterative_ensemble_smoother.SIES`, written
+against the NumPy array API so that it runs on `CuPy <https://cupy.dev>`_,
+whose matrix products, solves and SVDs call cuBLAS and cuSOLVER. Device
+arrays from other libraries are used without copying through
+``__cuda_array_interface__`` or DLPack, and the coefficient matrix stays on
+the device across iterations. CuPy is only imported when the class is used
+without an explicit array module.
+"""
+from __future__ import annotations
+
+import importlib
+from types import ModuleType
+from typing import Any, Optional, Union, TYPE_CHECKING
+
+import numpy as np
+
+if TYPE_CHECKING:
+    import numpy.typing as npt
+
+from ._ies import ErrorCovariance, InversionType
+from .utils import _create_errors, _validate_inputs
+
+# The DLDeviceType of host memory
+_DLPACK_CPU = 1
+
+
+def _num_significant(
+    singular_values: npt.NDArray[np.double], truncation: Union[float, int]
+) -> int:
+    """The number of singular values kept for the given truncation, as in
+    svdS in ies.hpp. Singular values are kept while those before them
+    account for less than the fraction ``truncation`` of the total variance.
+    """
+    if isinstance(truncation, (int, np.integer)):
+        return min(int(truncation), len(singular_values))
+    sigma2 = singular_values**2
+    preceding = np.concatenate(([0.0], np.cumsum(sigma2)[:-1]))
+    return int(np.count_nonzero(preceding / sigma2.sum() < truncation))
+
+
+class SIES:
+    """SIES with the arrays on a GPU. See
+    :class:`iterative_ensemble_smoother.SIES`.
+
+    Inputs may be NumPy arrays, which are copied to the device, or device
+    arrays. The results of :meth:`update` and :attr:`coefficient_matrix` are
+    arrays of ``array_module``.
+
+    :param ensemble_size: The number of realizations in the ensemble model.
+    :param array_module: The array library to compute with. Defaults to
+        ``cupy``, but any module with the NumPy API can be used, e.g.
+        ``numpy`` for comparing with the CPU implementation.
+    :param seed: Seed of the generator for the observation perturbations.
+    """
+
+    def __init__(
+        self,
+        ensemble_size: int,
+        *,
+        max_steplength: float = 0.6,
+        min_steplength: float = 0.3,
+        dec_steplength: float = 2.5,
+        array_module: Optional[ModuleType] = None,
+        seed: Optional[int] = None,
+    ):
+        if array_module is None:
+            try:
+                array_module = importlib.import_module("cupy")
+            except ImportError as err:
+                raise ImportError(
+                    "The GPU backend requires CuPy, see https://cupy.dev"
+                ) from err
+        self._xp: Any = array_module
+        self._rng: Any = self._xp.random.default_rng(seed)
+        self._initial_ensemble_size = ensemble_size
+        self.iteration_nr = 1
+        self.max_steplength = max_steplength
+        self.min_steplength = min_steplength
+        self.dec_steplength = dec_steplength
+        self._W: Any = self._xp.zeros((ensemble_size, ensemble_size))
+        self._active: Any = self._xp.arange(ensemble_size)
+
+    @property
+    def coefficient_matrix(self) -> Any:
+        """The coefficient matrix W of the initial ensemble, on the device."""
+        return self._W
+
+    def _get_steplength(self, iteration_nr: int) -> float:
+        """Eq. (49), see :meth:`iterative_ensemble_smoother.SIES._get_steplength`."""
+        steplength = self.min_steplength + (
+            self.max_steplength - self.min_steplength
+        ) * pow(2, -(iteration_nr - 1) / (self.dec_steplength - 1))
+        return steplength
+
+    def _asarray(self, array: Any) -> Any:
+        """array on the device, without copying it if it is already there.
+
+        DLPack is only used for arrays on a device, as e.g. CuPy does not
+        import host arrays through it, and NumPy arrays also have
+        ``__dlpack__``.
+        """
+        if (
+            not hasattr(array, "__cuda_array_interface__")
+            and hasattr(array, "__dlpack_device__")
+            and array.__dlpack_device__()[0] != _DLPACK_CPU
+        ):
+            return self._xp.from_dlpack(array)
+        return self._xp.asarray(array)
+
+    def fit(
+        self,
+        response_ensemble: Any,
+        observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
+        observation_values: npt.NDArray[np.double],
+        *,
+        noise: Optional[Any] = None,
+        truncation: Union[float, int] = 0.98,
+        step_length: Optional[float] = None,
+        ensemble_mask: Optional[npt.NDArray[np.bool_]] = None,
+        inversion: InversionType = InversionType.EXACT,
+        param_ensemble: Optional[Any] = None,
+    ) -> None:
+        """Perform one step of the iterative ensemble smoother algorithm. See
+        :meth:`iterative_ensemble_smoother.SIES.fit` for the parameters.
+
+        An ``ErrorCovariance`` is used in its dense form, except for the
+        identity and diagonal forms. Low-rank covariances are not supported.
+        """
+        xp = self._xp
+        if isinstance(observation_errors, ErrorCovariance):
+            observation_errors = self._dense_errors(observation_errors)
+        observation_errors = np.asarray(self._to_host(observation_errors))
+        observation_values = np.asarray(self._to_host(observation_values))
+        Y = self._asarray(response_ensemble)
+        if noise is not None:
+            noise = self._asarray(noise)
+        _validate_inputs(Y, noise, observation_errors, observation_values)
+        if step_length is None:
+            step_length = self._get_steplength(self.iteration_nr)
+
+        if ensemble_mask is None:
+            active = xp.arange(self._initial_ensemble_size)
+        else:
+            if len(ensemble_mask) != self._initial_ensemble_size:
+                raise ValueError("ensemble_mask must have one element per realization")
+            active = xp.flatnonzero(xp.asarray(ensemble_mask))
+        if len(active) != Y.shape[1]:
+            raise ValueError(
+                "Number of active realizations must match the number of columns of Y"
+            )
+        self._active = active
+        ensemble_size = Y.shape[1]
+        num_obs = Y.shape[0]
+
+        R, errors = _create_errors(observation_errors, inversion)
+        scale = xp.asarray(errors, dtype=Y.dtype)[:, None]
+
+        # Columns of E are sampled from N(0,Cdd) and centered, Evensen 2019.
+        # D and E are scaled with observation error standard deviations.
+        if noise is None:
+            noise = self._rng.standard_normal(size=(num_obs, ensemble_size))
+        noise = xp.asarray(noise, dtype=Y.dtype)
+        if len(observation_errors.shape) == 2:
+            L = xp.linalg.cholesky(xp.asarray(observation_errors, dtype=Y.dtype))
+            E = L @ noise
+        else:
+            E = xp.abs(scale) * noise
+        E = E - E.mean(axis=1, keepdims=True)
+        D = (xp.asarray(observation_values, dtype=Y.dtype)[:, None] + E - Y) / scale
+        E = E / scale
+
+        if param_ensemble is not None:
+            A = self._asarray(param_ensemble)
+            A = (A - A.mean(axis=1, keepdims=True)) / np.sqrt(ensemble_size - 1)
+            Y = Y @ (xp.linalg.pinv(A) @ A)
+        Y = Y / scale
+        Y = (Y - Y.mean(axis=1, keepdims=True)) / np.sqrt(ensemble_size - 1)
+
+        if isinstance(R, ErrorCovariance):
+            # Only for standard deviations, which scaled by themselves leave
+            # R = I
+            R = None
+        elif R is not None:
+            R = xp.asarray(R, dtype=Y.dtype)
+
+        index = xp.ix_(self._active, self._active)
+        W = self._create_coefficient_matrix(
+            Y, R, E, D, inversion, truncation, self._W[index], step_length
+        )
+        if bool(xp.isnan(W).any()):
+            raise ValueError(
+                "Fit produces NaNs. Check your response matrix for outliers or "
+                "use an inversion type with truncation."
+            )
+        self._W[index] = W
+
+        self.iteration_nr += 1
+
+    @staticmethod
+    def _dense_errors(
+        observation_errors: ErrorCovariance,
+    ) -> npt.NDArray[np.double]:
+        """The standard deviations of identity and diagonal covariances, and
+        the dense covariance of the others, as taken by :meth:`fit`."""
+        kind = observation_errors.kind
+        if kind in (ErrorCovariance.Kind.IDENTITY, ErrorCovariance.Kind.DIAGONAL):
+            errors: npt.NDArray[np.double] = np.sqrt(observation_errors.variances())
+            return errors
+        if kind == ErrorCovariance.Kind.LOW_RANK:
+            # The perturbations of the CPU use a symmetric factor of R, not
+            # its Cholesky factor, and the dense form would defeat its purpose
+            raise NotImplementedError(
+                "Low-rank error covariances are not supported on the GPU"
+            )
+        dense: npt.NDArray[np.double] = observation_errors.to_dense()
+        return dense
+
+    def _create_coefficient_matrix(
+        self,
+        Y: Any,
+        R: Optional[Any],
+        E: Any,
+        D: Any,
+        inversion: InversionType,
+        truncation: Union[float, int],
+        W: Any,
+        step_length: float,
+    ) -> Any:
+        """Lines 5 to 9 of Algorithm 1, see create_coefficient_matrix in
+        ies.hpp. As there, W and the products of size (ensemble_size,
+        ensemble_size) are kept in double precision."""
+        xp = self._xp
+        ensemble_size = Y.shape[1]
+        identity = xp.eye(ensemble_size)
+
+        # Line 5 and 6, S * Omega = Y
+        Omega = identity + (W - W.mean(axis=1, keepdims=True)) / np.sqrt(
+            ensemble_size - 1
+        )
+        S = xp.linalg.solve(Omega.T, Y.T.astype(W.dtype)).T.astype(Y.dtype)
+
+        # Line 7
+        H = D + S @ W.astype(Y.dtype)
+
+        # Line 8, Section 3.2 and Sections 3.3 and 3.4
+        if inversion == InversionType.EXACT:
+            K = xp.linalg.solve((S.T @ S).astype(W.dtype) + identity, S.T @ H)
+        else:
+            U, sigma, _ = xp.linalg.svd(S, full_matrices=False)
+            num_significant = _num_significant(
+                np.asarray(self._to_host(sigma)), truncation
+            )
+            U0 = U[:, :num_significant]
+            inv_sigma = 1 / sigma[:num_significant]
+            nsc = 1 / np.sqrt(ensemble_size - 1)
+
+            if inversion == InversionType.SUBSPACE_RE:
+                X0 = inv_sigma[:, None] * (nsc * U0.T @ E)
+                U1, sigma1, _ = xp.linalg.svd(X0, full_matrices=False)
+                eig = 1 / (1 + sigma1**2)
+            else:
+                B = U0.T @ U0 if R is None else U0.T @ R @ U0
+                B = inv_sigma[:, None] * B * inv_sigma[None, :]
+                U1, lambda1, _ = xp.linalg.svd(B, full_matrices=False)
+                eig = 1 / (1 + lambda1)
+
+            X1 = U0 @ (inv_sigma[:, None] * U1)
+            X3 = X1 @ (eig[:, None] * (X1.T @ H))
+            K = (S.T @ X3).astype(W.dtype)
+
+        # Line 9
+        return (1 - step_length) * W + step_length * K
+
+    def _to_host(self, array: Any) -> Any:
+        """array as a NumPy array, copying it from the device if needed."""
+        return array.get() if hasattr(array, "get") else array
+
+    def transition_matrix(self) -> Any:
+        """I + W / sqrt(N - 1) for the active realizations, on the device."""
+        ensemble_size = len(self._active)
+        W = self._W[self._xp.ix_(self._active, self._active)]
+        return self._xp.eye(ensemble_size) + W / np.sqrt(ensemble_size - 1)
+
+    def update(self, param_ensemble: Any) -> Any:
+        """Update the parameters of the active realizations on the device,
+        Line 9 of Algorithm 1."""
+        A = self._asarray(param_ensemble)
+        return A @ self.transition_matrix().astype(A.dtype)
+
+    def __repr__(self) -> str:
+        return (
+            f"gpu.SIES(ensemble_size={self._initial_ensemble_size}, "
+            f"max_steplength={self.max_steplength}, "
+            f"min_steplength={self.min_steplength}, "
+            f"dec_steplength={self.dec_steplength})"
+        )
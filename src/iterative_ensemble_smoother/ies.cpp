@@ -1,298 +1,381 @@
-#include <algorithm>
-#include <memory>
-#include <variant>
-
-#include <Eigen/Dense>
 #include <pybind11/eigen.h>
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
-using Eigen::ComputeThinU;
-using Eigen::ComputeThinV;
-using Eigen::MatrixXd;
-using Eigen::VectorXd;
-namespace py = pybind11;
-
-enum struct Inversion { exact = 0, subspace_exact_r = 1, subspace_re = 3 };
+#include "ies.hpp"
 
-int calc_num_significant(const VectorXd &singular_values, double truncation) {
-  int num_significant = 0;
-  double total_sigma2 = singular_values.squaredNorm();
-
-  /*
-   * Determine the number of singular values by enforcing that
-   * less than a fraction @truncation of the total variance be
-   * accounted for.
-   */
-  double running_sigma2 = 0;
-  for (auto sig : singular_values) {
-    if (running_sigma2 / total_sigma2 <
-        truncation) { /* Include one more singular value ? */
-      num_significant++;
-      running_sigma2 += sig * sig;
-    } else
-      break;
-  }
+namespace py = pybind11;
 
-  return num_significant;
-}
+/* Set by setup.py when Eigen delegates to a vendor BLAS/LAPACK */
+#ifndef IES_BLAS_BACKEND
+#define IES_BLAS_BACKEND "eigen"
+#endif
 
-/**
- * Implements parts of Eq. 14.31 in the book Data Assimilation,
- * The Ensemble Kalman Filter, 2nd Edition by Geir Evensen.
- * Specifically, this implements
- * X_1 (I + \Lambda_1)^{-1} X_1^T (D - M[A^f])
+/*
+ * Set by setup.py for each build of the module with other instruction set
+ * flags, see _ies.py
  */
-MatrixXd genX3(const MatrixXd &W, const MatrixXd &D, const VectorXd &eig) {
-  const int nrmin = std::min(D.rows(), D.cols());
-  // Corresponds to (I + \Lambda_1)^{-1} since `eig` has already been
-  // transformed.
-  MatrixXd Lambda_inv = eig(Eigen::seq(0, nrmin - 1)).asDiagonal();
-  MatrixXd X1 = Lambda_inv * W.transpose();
-
-  MatrixXd X2 = X1 * D;
-  MatrixXd X3 = W * X2;
-
-  return X3;
-}
-
-int svdS(const MatrixXd &S, const std::variant<double, int> &truncation,
-         VectorXd &inv_sig0, MatrixXd &U0) {
-
-  int num_significant = 0;
-
-  auto svd = S.bdcSvd(ComputeThinU);
-  U0 = svd.matrixU();
-  VectorXd singular_values = svd.singularValues();
-
-  if (std::holds_alternative<int>(truncation)) {
-    num_significant = std::get<int>(truncation);
-  } else {
-    num_significant =
-        calc_num_significant(singular_values, std::get<double>(truncation));
-  }
-
-  inv_sig0 = singular_values.cwiseInverse();
-
-  inv_sig0(Eigen::seq(num_significant, Eigen::last)).setZero();
-
-  return num_significant;
-}
-
-/**
- Routine computes X1 and eig corresponding to Eqs 14.54-14.55
- Geir Evensen
-*/
-void lowrankE(
-    const MatrixXd &S, /* (nrobs x nrens) */
-    const MatrixXd &E, /* (nrobs x nrens) */
-    MatrixXd &W, /* (nrobs x nrmin) Corresponding to X1 from Eqs. 14.54-14.55 */
-    VectorXd &eig, /* (nrmin) Corresponding to 1 / (1 + Lambda1^2) (14.54) */
-    const std::variant<double, int> &truncation) {
-
-  const int nrobs = S.rows();
-  const int nrens = S.cols();
-  const int nrmin = std::min(nrobs, nrens);
-
-  VectorXd inv_sig0(nrmin);
-  MatrixXd U0(nrobs, nrmin);
-
-  /* Compute SVD of S=HA`  ->  U0, invsig0=sig0^(-1) */
-  svdS(S, truncation, inv_sig0, U0);
-
-  MatrixXd Sigma_inv = inv_sig0.asDiagonal();
-
-  /* X0(nrmin x nrens) =  Sigma0^(+) * U0'* E  (14.51)  */
-  MatrixXd X0 = Sigma_inv * U0.transpose() * E;
-
-  /* Compute SVD of X0->  U1*eig*V1   14.52 */
-  auto svd = X0.bdcSvd(ComputeThinU);
-  const auto &sig1 = svd.singularValues();
-
-  /* Lambda1 = 1/(I + Lambda^2)  in 14.56 */
-  for (int i = 0; i < nrmin; i++)
-    eig[i] = 1.0 / (1.0 + sig1[i] * sig1[i]);
-
-  /* Compute X1 = W = U0 * (U1=sig0^+ U1) = U0 * Sigma0^(+') * U1  (14.55) */
-  W = U0 * Sigma_inv.transpose() * svd.matrixU();
-}
-
-void lowrankCinv(
-    const MatrixXd &S, const MatrixXd &R,
-    MatrixXd &W,   /* Corresponding to X1 from Eq. 14.29 */
-    VectorXd &eig, /* Corresponding to 1 / (1 + Lambda_1) (14.29) */
-    const std::variant<double, int> &truncation) {
-
-  const int nrobs = S.rows();
-  const int nrens = S.cols();
-  const int nrmin = std::min(nrobs, nrens);
-
-  MatrixXd U0(nrobs, nrmin);
-  MatrixXd Z(nrmin, nrmin);
-
-  VectorXd inv_sig0(nrmin);
-  svdS(S, truncation, inv_sig0, U0);
-
-  MatrixXd Sigma_inv = inv_sig0.asDiagonal();
-
-  /* B = Xo = (N-1) * Sigma0^(+) * U0'* Cee * U0 * Sigma0^(+')  (14.26)*/
-  MatrixXd B = (nrens - 1.0) * Sigma_inv * U0.transpose() * R * U0 *
-               Sigma_inv.transpose();
-
-  auto svd = B.bdcSvd(ComputeThinU);
-  Z = svd.matrixU();
-  eig = svd.singularValues();
-
-  /* Lambda1 = (I + Lambda)^(-1) */
-  for (int i = 0; i < nrmin; i++)
-    eig[i] = 1.0 / (1 + eig[i]);
-
-  Z = Sigma_inv * Z;
-
-  W = U0 * Z; /* X1 = W = U0 * Z2 = U0 * Sigma0^(+') * Z    */
-}
+#ifndef IES_MODULE_NAME
+#define IES_MODULE_NAME _ies
+#endif
+#ifndef IES_SIMD_VARIANT
+#define IES_SIMD_VARIANT "baseline"
+#endif
 
 /**
- * Sections 3.3 and 3.4
+ * Runs compute on a writeable (rows x cols) view of `out`, or of a new matrix
+ * if out is None, with the GIL released. Returns `out` or the new matrix.
+ *
+ * out may have either memory layout, e.g. an np.memmap, but must have the
+ * dtype of the result since it is never copied.
  */
-void subspace_inversion(MatrixXd &W, const Inversion ies_inversion,
-                        const MatrixXd &E,
-                        std::optional<py::EigenDRef<MatrixXd>> R,
-                        const MatrixXd &S, const MatrixXd &H,
-                        const std::variant<double, int> &truncation,
-                        double ies_steplength) {
-  int ens_size = S.cols();
-  int nrobs = S.rows();
-  double nsc = 1.0 / sqrt(ens_size - 1.0);
-  MatrixXd X1 = MatrixXd::Zero(
-      nrobs, std::min(ens_size, nrobs)); // Used in subspace inversion
-  VectorXd eig(ens_size);
-
-  switch (ies_inversion) {
-  case Inversion::subspace_re:
-    lowrankE(S, E * nsc, X1, eig, truncation);
-    break;
-
-  case Inversion::subspace_exact_r:
-    lowrankCinv(S, R.value() * nsc * nsc, X1, eig, truncation);
-    break;
-
-  default:
-    break;
+template <typename Scalar, typename Compute>
+py::object compute_into(const std::optional<py::array> &out, Index rows,
+                        Index cols, Compute compute) {
+  if (!out) {
+    MatrixX<Scalar> result(rows, cols);
+    {
+      py::gil_scoped_release release;
+      compute(StridedRef<Scalar>(result));
+    }
+    return py::cast(std::move(result));
   }
 
-  // X3 = X1 * diag(eig) * X1' * H (Similar to Eq. 14.31, Evensen (2007))
-  Eigen::Map<VectorXd> eig_vector(eig.data(), eig.size());
-  MatrixXd X3 = genX3(X1, H, eig_vector);
-
-  // (Line 9)
-  W = ies_steplength * S.transpose() * X3 + (1.0 - ies_steplength) * W;
+  std::optional<StridedRef<Scalar>> view;
+  try {
+    view.emplace(out->cast<StridedRef<Scalar>>());
+  } catch (const py::cast_error &) {
+    throw std::invalid_argument(
+        "out must be a writeable array with the dtype of the inputs");
+  }
+  if (view->rows() != rows || view->cols() != cols)
+    throw std::invalid_argument("out has the wrong shape");
+  {
+    py::gil_scoped_release release;
+    compute(*view);
+  }
+  return *out;
 }
 
 /**
- * Section 3.2 - Exact inversion assuming diagonal error covariance matrix
+ * W is given and returned in the precision of Y, E and D, but the iteration
+ * itself keeps it in double, see ies.hpp. The result may be written to W
+ * itself by passing it as `out`.
  */
-void exact_inversion(MatrixXd &W, const MatrixXd &S, const MatrixXd &H,
-                     double ies_steplength) {
-  int ens_size = S.cols();
-
-  MatrixXd C = S.transpose() * S;
-  C.diagonal().array() += 1;
-
-  auto svd = C.bdcSvd(Eigen::ComputeFullV);
-
-  W = W - ies_steplength *
-              (W - svd.matrixV() *
-                       svd.singularValues().cwiseInverse().asDiagonal() *
-                       svd.matrixV().transpose() * S.transpose() * H);
+template <typename Scalar>
+py::object create_coefficient_matrix(
+    ConstStridedRef<Scalar> Y, const ErrorCovariance *R,
+    ConstStridedRef<Scalar> E, ConstStridedRef<Scalar> D,
+    const Inversion ies_inversion, const std::variant<double, int> &truncation,
+    ConstStridedRef<Scalar> W, double ies_steplength,
+    Factorization factorization, double omega_rcond, SVDEngine svd_engine,
+    int oversampling, int power_iterations, std::optional<py::array> out) {
+  SolverOptions options;
+  options.factorization = factorization;
+  options.omega_rcond = omega_rcond;
+  options.svd_engine = svd_engine;
+  options.oversampling = oversampling;
+  options.power_iterations = power_iterations;
+
+  MatrixXd W_d = W.template cast<double>();
+  return compute_into<Scalar>(
+      out, W.rows(), W.cols(), [&](StridedRef<Scalar> result) {
+        Workspace<Scalar> ws;
+        create_coefficient_matrix<Scalar>(Y, R, E, D, ies_inversion,
+                                          truncation, W_d, ies_steplength,
+                                          options, ws);
+        result = W_d.template cast<Scalar>();
+      });
 }
 
-/**
- * @brief Computer coefficient matrix (W) following steps 4-8
- * of Algorithm 1.
- *
- * W = W - ies_steplength * (W - S' * (S * S' + R)^{-1} * H)
- * When R=I Line 9 can be rewritten as
- * W = W - ies_steplength * ( W - (S'*S + I)^{-1} * S' * H )
- * Notice the expression being inverted.
- * Instead of S * S' which is a (num_obs, num_obs) sized matrix,
- * we get S' * S which is of size (ensemble_size, ensemble_size).
- * This is great since num_obs is usually much larger than ensemble_size.
- *
- * @param Y Predicted ensemble anomalies normalized by sqrt(N-1),
- *          where N is the number of realizations.
- *          See line 4 of Algorithm 1 and Eq. 30.
- */
-MatrixXd create_coefficient_matrix(py::EigenDRef<MatrixXd> Y,
-                                   std::optional<py::EigenDRef<MatrixXd>> R,
-                                   py::EigenDRef<MatrixXd> E,
-                                   py::EigenDRef<MatrixXd> D,
-                                   const Inversion ies_inversion,
-                                   const std::variant<double, int> &truncation,
-                                   MatrixXd &W, double ies_steplength)
-
-{
-  const int ens_size = Y.cols();
-
-  /* Line 5 of Algorithm 1 */
-  MatrixXd Omega =
-      (1.0 / sqrt(ens_size - 1.0)) * (W.colwise() - W.rowwise().mean());
-  Omega.diagonal().array() += 1.0;
-
-  /* Solving for the average sensitivity matrix.
-     Line 6 of Algorithm 1, also Section 5
-  */
-  Omega.transposeInPlace();
-  MatrixXd S = Omega.fullPivLu().solve(Y.transpose()).transpose();
-
-  /* Similar to the innovation term.
-     Differs in that `D` here is defined as dobs + E - Y instead of just dobs +
-     E as in the paper. Line 7 of Algorithm 1, also Section 2.6
-  */
-  MatrixXd H = D + S * W;
-
-  /*
-   * With R=I the subspace inversion (ies_inversion=1) with
-   * singular value trucation=1.000 gives exactly the same solution as the exact
-   * inversion (`ies_inversion`=Inversion::exact).
-   *
-   * With very large data sets it is likely that the inversion becomes poorly
-   * conditioned and a trucation=1.0 is not a good choice. In this case
-   * `ies_inversion` other than Inversion::exact and truncation set to less
-   * than 1.0 could stabilize the algorithm.
-   */
+template <typename Scalar>
+py::object make_D(const VectorXd &obs_values, ConstStridedRef<Scalar> E,
+                  ConstStridedRef<Scalar> S, std::optional<py::array> out) {
+  return compute_into<Scalar>(out, E.rows(), E.cols(),
+                              [&](StridedRef<Scalar> D) {
+                                makeD<Scalar>(obs_values, E, S, D);
+                              });
+}
 
-  if (ies_inversion == Inversion::exact) {
-    exact_inversion(W, S, H, ies_steplength);
+/* See create_coefficient_matrix, W is cast in the same way */
+template <typename Scalar>
+std::vector<MatrixX<Scalar>> create_coefficient_matrices_as(
+    const ConstStridedRef<Scalar> &Y, const ErrorCovariance *R,
+    const ConstStridedRef<Scalar> &E, const ConstStridedRef<Scalar> &D,
+    const Inversion ies_inversion, const std::variant<double, int> &truncation,
+    const ConstStridedRef<Scalar> &W,
+    double ies_steplength, const std::vector<IndexVector> &observation_subsets,
+    const SolverOptions &options) {
+  std::vector<MatrixXd> coefficient_matrices =
+      create_coefficient_matrices<Scalar>(
+          Y, R, E, D, ies_inversion, truncation, W.template cast<double>(),
+          ies_steplength, observation_subsets, options);
+  if constexpr (std::is_same_v<Scalar, double>) {
+    return coefficient_matrices;
   } else {
-    subspace_inversion(W, ies_inversion, E, R, S, H, truncation,
-                       ies_steplength);
+    std::vector<MatrixX<Scalar>> result;
+    result.reserve(coefficient_matrices.size());
+    for (const auto &W_i : coefficient_matrices)
+      result.push_back(W_i.template cast<Scalar>());
+    return result;
   }
-
-  return W;
 }
 
-MatrixXd makeD(const VectorXd &obs_values, const MatrixXd &E,
-               const MatrixXd &S) {
-
-  MatrixXd D = E - S;
-
-  D.colwise() += obs_values;
-
-  return D;
+/**
+ * Binds the kernels that take the (nrobs x nrens) or parameter matrices in
+ * the precision Scalar. Overloads are tried in the order they are bound, and
+ * with implicit conversions only after none matched without, which a dense R
+ * always needs. So the float overloads are bound first and only take a
+ * float32 response or parameter matrix, and other dtypes convert to double.
+ */
+template <typename Scalar> void bind_kernels(py::module_ &m) {
+  using namespace py::literals;
+  constexpr bool exact = std::is_same_v<Scalar, float>;
+
+  m.def("create_coefficient_matrix",
+        py::overload_cast<ConstStridedRef<Scalar>, const ErrorCovariance *,
+                          ConstStridedRef<Scalar>, ConstStridedRef<Scalar>,
+                          const Inversion, const std::variant<double, int> &,
+                          ConstStridedRef<Scalar>, double, Factorization,
+                          double, SVDEngine, int, int,
+                          std::optional<py::array>>(
+            &create_coefficient_matrix<Scalar>),
+        py::arg("Y0").noconvert(exact), "R"_a = py::none(), "E"_a, "D"_a,
+        "ies_inversion"_a, "truncation"_a, "W"_a, "ies_steplength"_a,
+        "factorization"_a = Factorization::cholesky, "omega_rcond"_a = 0.0,
+        "svd_engine"_a = SVDEngine::exact, "oversampling"_a = 10,
+        "power_iterations"_a = 2, "out"_a = py::none());
+  m.def("make_D", &make_D<Scalar>, "obs_values"_a, "E"_a,
+        py::arg("S").noconvert(exact), "out"_a = py::none());
+  m.def("make_E_D", &make_E_D<Scalar>, "obs_values"_a, "C"_a,
+        py::arg("S").noconvert(exact), "noise"_a = py::none(),
+        "seed"_a = py::none(), "scale"_a = py::none(),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("make_Y_E_D", &make_Y_E_D<Scalar>, "obs_values"_a, "C"_a,
+        py::arg("S").noconvert(exact), "noise"_a = py::none(),
+        "seed"_a = py::none(), "scale"_a = py::none(),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("compress_observations", &compress_observations<Scalar>,
+        py::arg("Y0").noconvert(exact), "R"_a = py::none(), "E"_a, "D"_a,
+        py::call_guard<py::gil_scoped_release>());
+  m.def("create_coefficient_matrices", &create_coefficient_matrices_as<Scalar>,
+        py::arg("Y0").noconvert(exact), "R"_a = py::none(), "E"_a, "D"_a,
+        "ies_inversion"_a, "truncation"_a, "W"_a, "ies_steplength"_a,
+        "observation_subsets"_a, "options"_a = SolverOptions(),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("ensemble_smoother_sweep", &ensemble_smoother_sweep<Scalar>,
+        py::arg("Y0").noconvert(exact), "R"_a = py::none(), "D0"_a, "E"_a,
+        "inflations"_a, "ies_inversion"_a, "truncation"_a,
+        py::call_guard<py::gil_scoped_release>());
+  m.def(
+      "factorize_coefficient_matrix",
+      [](ConstStridedRef<Scalar> Y, const ErrorCovariance *R,
+         ConstStridedRef<Scalar> E, ConstStridedRef<Scalar> D,
+         const Inversion ies_inversion, const MatrixXd &W,
+         const SolverOptions &options) {
+        return CoefficientMatrixFactors(Y, R, E, D, ies_inversion, W,
+                                        options);
+      },
+      py::arg("Y0").noconvert(exact), "R"_a = py::none(), "E"_a, "D"_a,
+      "ies_inversion"_a, "W"_a, "options"_a = SolverOptions(),
+      py::call_guard<py::gil_scoped_release>());
+  m.def("apply_transition_matrix", &apply_transition_matrix<Scalar>,
+        py::arg("A").noconvert(exact), "T"_a, "block_rows"_a = 4096,
+        py::call_guard<py::gil_scoped_release>());
+  m.def("apply_row_scaling", &apply_row_scaling<Scalar>,
+        py::arg("A").noconvert(exact), "scaling"_a, "W"_a,
+        "block_rows"_a = 4096, py::call_guard<py::gil_scoped_release>());
 }
 
-PYBIND11_MODULE(_ies, m) {
+PYBIND11_MODULE(IES_MODULE_NAME, m) {
   using namespace py::literals;
 
-  m.def("create_coefficient_matrix", &create_coefficient_matrix, "Y0"_a,
-        "R"_a = py::none(), "E"_a, "D"_a, "ies_inversion"_a, "truncation"_a,
-        "W"_a, "ies_steplength"_a);
-  m.def("make_D", &makeD, "obs_values"_a, "E"_a, "S"_a);
+  /* The kernels release the GIL, so Eigen may be called from many threads */
+  Eigen::initParallel();
+
+  py::class_<ErrorCovariance> error_covariance(m, "ErrorCovariance");
+
+  py::enum_<ErrorCovariance::Kind>(error_covariance, "Kind")
+      .value("IDENTITY", ErrorCovariance::Kind::identity)
+      .value("DIAGONAL", ErrorCovariance::Kind::diagonal)
+      .value("BLOCK_DIAGONAL", ErrorCovariance::Kind::block_diagonal)
+      .value("LOW_RANK", ErrorCovariance::Kind::low_rank)
+      .value("DENSE", ErrorCovariance::Kind::dense);
+
+  error_covariance.def(py::init<MatrixXd>(), "dense"_a)
+      .def_static("identity", &ErrorCovariance::identity, "size"_a)
+      .def_static("diagonal", &ErrorCovariance::diagonal, "variances"_a)
+      .def_static("block_diagonal", &ErrorCovariance::block_diagonal,
+                  "blocks"_a)
+      .def_static("low_rank", &ErrorCovariance::low_rank, "variances"_a,
+                  "factor"_a)
+      .def_property_readonly("kind", &ErrorCovariance::kind)
+      .def_property_readonly("size", &ErrorCovariance::size)
+      .def("project", &ErrorCovariance::project, "U"_a)
+      .def("variances", &ErrorCovariance::variances)
+      .def("scaled", &ErrorCovariance::scaled, "scale"_a)
+      .def("to_dense", &ErrorCovariance::to_dense);
+
+  py::implicitly_convertible<py::array, ErrorCovariance>();
+
+  py::class_<SolverOptions>(m, "SolverOptions")
+      .def(py::init<>())
+      .def_readwrite("factorization", &SolverOptions::factorization)
+      .def_readwrite("omega_rcond", &SolverOptions::omega_rcond)
+      .def_readwrite("svd_engine", &SolverOptions::svd_engine)
+      .def_readwrite("oversampling", &SolverOptions::oversampling)
+      .def_readwrite("power_iterations", &SolverOptions::power_iterations);
+
+  bind_kernels<float>(m);
+  bind_kernels<double>(m);
+
+  py::class_<GramAccumulator>(m, "GramAccumulator")
+      .def(py::init<Index>(), "ensemble_size"_a)
+      .def("add", &GramAccumulator::add<float>, py::arg("Y0").noconvert(),
+           "D"_a, py::call_guard<py::gil_scoped_release>())
+      .def("add", &GramAccumulator::add<double>, "Y0"_a, "D"_a,
+           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "update",
+          [](const GramAccumulator &gram, MatrixXd W, double ies_steplength,
+             const SolverOptions &options) {
+            Workspace<double> ws;
+            gram.update(W, ies_steplength, options, ws);
+            return W;
+          },
+          "W"_a, "ies_steplength"_a, "options"_a = SolverOptions(),
+          py::call_guard<py::gil_scoped_release>())
+      .def("reset", &GramAccumulator::reset)
+      .def_property_readonly("ensemble_size", &GramAccumulator::ensemble_size)
+      .def_property_readonly("num_observations",
+                             &GramAccumulator::num_observations);
+
+  py::class_<CoefficientMatrixFactors>(m, "CoefficientMatrixFactors")
+      .def("update_direction", &CoefficientMatrixFactors::update_direction,
+           "truncation"_a, py::call_guard<py::gil_scoped_release>())
+      .def("coefficient_matrix", &CoefficientMatrixFactors::coefficient_matrix,
+           "truncation"_a, "ies_steplength"_a,
+           py::call_guard<py::gil_scoped_release>())
+      .def("coefficient_matrices",
+           &CoefficientMatrixFactors::coefficient_matrices, "truncation"_a,
+           "ies_steplengths"_a, py::call_guard<py::gil_scoped_release>())
+      .def("transition_matrix", &CoefficientMatrixFactors::transition_matrix,
+           "truncation"_a, "ies_steplength"_a,
+           py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly(
+          "initial_coefficient_matrix",
+          &CoefficientMatrixFactors::initial_coefficient_matrix)
+      .def_property_readonly("ensemble_size",
+                             &CoefficientMatrixFactors::ensemble_size)
+      .def_property_readonly("inversion", &CoefficientMatrixFactors::inversion);
+
+  using Mask = Eigen::Array<bool, Eigen::Dynamic, 1>;
+  py::class_<SIESState>(m, "SIESState")
+      .def(py::init<Index, SolverOptions>(), "ensemble_size"_a,
+           "options"_a = SolverOptions())
+      .def("fit", &SIESState::fit<float>, py::arg("Y0").noconvert(),
+           "R"_a = py::none(), "E"_a, "D"_a, "ies_inversion"_a,
+           "truncation"_a, "ies_steplength"_a,
+           "ensemble_mask"_a = py::none(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("fit", &SIESState::fit<double>, "Y0"_a, "R"_a = py::none(), "E"_a,
+           "D"_a, "ies_inversion"_a, "truncation"_a, "ies_steplength"_a,
+           "ensemble_mask"_a = py::none(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("fit",
+           static_cast<void (SIESState::*)(const GramAccumulator &, double,
+                                           const std::optional<Mask> &)>(
+               &SIESState::fit),
+           "gram"_a, "ies_steplength"_a, "ensemble_mask"_a = py::none(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("fit_incremental", &SIESState::fit_incremental<float>,
+           py::arg("Y0").noconvert(), "D"_a, "ies_steplength"_a,
+           "ensemble_mask"_a = py::none(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("fit_incremental", &SIESState::fit_incremental<double>, "Y0"_a,
+           "D"_a, "ies_steplength"_a, "ensemble_mask"_a = py::none(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("append_observations", &SIESState::append_observations<float>,
+           py::arg("Y0").noconvert(), "D"_a,
+           py::call_guard<py::gil_scoped_release>())
+      .def("append_observations", &SIESState::append_observations<double>,
+           "Y0"_a, "D"_a, py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly("num_incremental_observations",
+                             &SIESState::num_incremental_observations)
+      .def("factorize", &SIESState::factorize<float>,
+           py::arg("Y0").noconvert(), "R"_a = py::none(), "E"_a, "D"_a,
+           "ies_inversion"_a, "ensemble_mask"_a = py::none(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("factorize", &SIESState::factorize<double>, "Y0"_a,
+           "R"_a = py::none(), "E"_a, "D"_a, "ies_inversion"_a,
+           "ensemble_mask"_a = py::none(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("fit",
+           static_cast<void (SIESState::*)(const CoefficientMatrixFactors &,
+                                           const std::variant<double, int> &,
+                                           double)>(&SIESState::fit),
+           "factors"_a, "truncation"_a, "ies_steplength"_a,
+           py::call_guard<py::gil_scoped_release>())
+      .def("set_param_ensemble", &SIESState::set_param_ensemble<float>,
+           py::arg("param_ensemble").noconvert(),
+           py::call_guard<py::gil_scoped_release>())
+      .def("set_param_ensemble", &SIESState::set_param_ensemble<double>,
+           "param_ensemble"_a, py::call_guard<py::gil_scoped_release>())
+      .def("clear_param_ensemble", &SIESState::clear_param_ensemble)
+      .def("transition_matrix", &SIESState::transition_matrix)
+      /* Copied, as the buffer of W is swapped by the next fit */
+      .def_property_readonly("coefficient_matrix",
+                             &SIESState::coefficient_matrix,
+                             py::return_value_policy::copy)
+      .def_property_readonly("ensemble_mask", &SIESState::ensemble_mask)
+      .def_readwrite("options", &SIESState::options);
+
+  m.def("set_num_threads", &set_num_threads, "num_threads"_a);
+  m.def("get_num_threads", &get_num_threads);
+#ifdef _OPENMP
+  m.attr("has_openmp") = true;
+#else
+  m.attr("has_openmp") = false;
+#endif
+  m.attr("blas_backend") = IES_BLAS_BACKEND;
+  m.attr("simd_variant") = IES_SIMD_VARIANT;
+  m.attr("simd_instruction_sets") = Eigen::SimdInstructionSetsInUse();
+
+  m.def(
+      "set_profiling",
+      [](bool enabled) { profiler().enable(enabled); }, "enabled"_a,
+      "Enable or disable recording of the stages of the kernels.");
+  m.def("profiling_enabled", [] { return profiler().enabled(); });
+  m.def("reset_profile", [] { profiler().reset(); },
+        "Clear the recorded stages.");
+  m.def(
+      "profile_events",
+      [] {
+        py::list events;
+        for (const auto &event : profiler().events())
+          events.append(py::dict(
+              "name"_a = event.name, "call"_a = event.call,
+              "depth"_a = event.depth, "thread"_a = event.thread,
+              "start_us"_a = event.start_us,
+              "duration_us"_a = event.duration_us, "flops"_a = event.flops,
+              "bytes"_a = event.bytes));
+        return events;
+      },
+      "The stages recorded since the last reset_profile, in the order they "
+      "finished.");
 
   py::enum_<Inversion>(m, "InversionType")
       .value("EXACT", Inversion::exact)
       .value("EXACT_R", Inversion::subspace_exact_r)
       .value("SUBSPACE_RE", Inversion::subspace_re)
       .export_values();
+
+  py::enum_<Factorization>(m, "FactorizationType")
+      .value("CHOLESKY", Factorization::cholesky)
+      .value("SVD", Factorization::svd);
+
+  py::enum_<SVDEngine>(m, "SVDEngine")
+      .value("EXACT", SVDEngine::exact)
+      .value("RANDOMIZED", SVDEngine::randomized);
 }
@@ -0,0 +1,2170 @@
+/*
+ * Kernels of the subspace iterative ensemble smoother, Evensen et al. (2019),
+ * Efficient Implementation of an Iterative Ensemble Smoother for Data
+ * Assimilation and Reservoir History Matching.
+ *
+ * This header does not depend on pybind11, the bindings are in ies.cpp.
+ *
+ * The kernels are templated on the scalar type of the (nrobs x nrens)
+ * matrices Y, E, D and S, and of the parameter matrices, which may be float
+ * or double. The coefficient matrix W and the other (nrens x nrens) and
+ * (nrsig x nrens) matrices are always double, so the factorizations are
+ * done in double precision while the products with nrobs or num_params rows,
+ * which dominate the cost, run in the precision of the inputs.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include <Eigen/Dense>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * An OpenMP directive, which expands to nothing without OpenMP so that those
+ * builds do not warn about unknown pragmas.
+ */
+#ifdef _OPENMP
+#define IES_PRAGMA(...) _Pragma(#__VA_ARGS__)
+#define IES_OMP(...) IES_PRAGMA(omp __VA_ARGS__)
+#else
+#define IES_OMP(...)
+#endif
+
+#include "profiler.hpp"
+
+using Eigen::ComputeThinU;
+using Eigen::ComputeThinV;
+using Eigen::Index;
+using Eigen::MatrixX;
+using Eigen::MatrixXd;
+using Eigen::VectorX;
+using Eigen::VectorXd;
+using IndexVector = Eigen::Matrix<Index, Eigen::Dynamic, 1>;
+
+/*
+ * Matrices with arbitrary strides, so that both row-major and column-major
+ * NumPy arrays, e.g. an np.memmap, are used without copying them.
+ */
+template <typename Scalar>
+using StridedRef = Eigen::Ref<MatrixX<Scalar>, 0,
+                              Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>>;
+template <typename Scalar>
+using ConstStridedRef =
+    Eigen::Ref<const MatrixX<Scalar>, 0,
+               Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>>;
+
+/**
+ * Calls f with A mapped with unit inner stride, column-major or row-major
+ * depending on the layout of A. Eigen copies operands of a matrix product
+ * that have a non-unit inner stride, so this avoids copying A in products.
+ * A is only copied if neither of its strides is one.
+ */
+template <typename Scalar, typename F>
+void with_unit_inner_stride(const ConstStridedRef<Scalar> &A, F &&f) {
+  using RowMajor =
+      Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+  if (A.innerStride() == 1) {
+    f(Eigen::Map<const MatrixX<Scalar>, 0, Eigen::OuterStride<>>(
+        A.data(), A.rows(), A.cols(), Eigen::OuterStride<>(A.outerStride())));
+  } else if (A.outerStride() == 1) {
+    f(Eigen::Map<const RowMajor, 0, Eigen::OuterStride<>>(
+        A.data(), A.rows(), A.cols(), Eigen::OuterStride<>(A.innerStride())));
+  } else {
+    f(MatrixX<Scalar>(A));
+  }
+}
+
+enum struct Inversion { exact = 0, subspace_exact_r = 1, subspace_re = 3 };
+
+/* Factorization of S' * S + I used by Inversion::exact */
+enum struct Factorization { cholesky = 0, svd = 1 };
+
+/* Method used to compute the truncated SVD of S in the subspace inversions */
+enum struct SVDEngine { exact = 0, randomized = 1 };
+
+/**
+ * Choices of numerical method that do not change the result of
+ * create_coefficient_matrix, other than through rounding.
+ */
+struct SolverOptions {
+  /* See exact_inversion */
+  Factorization factorization = Factorization::cholesky;
+  /*
+   * Omega is solved with partial pivoting LU. If the reciprocal condition
+   * number estimate of Omega is below omega_rcond, full pivoting LU is used
+   * instead. The default of 0 disables the check.
+   */
+  double omega_rcond = 0.0;
+  /*
+   * See svdS. The randomized engine approximates the leading singular
+   * triplets of S, which changes the result slightly.
+   */
+  SVDEngine svd_engine = SVDEngine::exact;
+  int oversampling = 10;
+  int power_iterations = 2;
+};
+
+/**
+ * Observation error covariance matrix R.
+ *
+ * R is only ever used through products of the form U' * R * U, so it is stored
+ * in the most compact form the caller can describe. Memory and cost are then
+ * linear in the number of observations for all but the dense form.
+ *
+ * - identity: R = I
+ * - diagonal: R = diag(variances)
+ * - block_diagonal: R = blkdiag(R_1, ..., R_k) where each block covers a
+ *   contiguous range of observations, e.g. the time series of one well.
+ * - low_rank: R = diag(variances) + F * F'
+ * - dense: R as given.
+ */
+class ErrorCovariance {
+public:
+  enum struct Kind { identity, diagonal, block_diagonal, low_rank, dense };
+
+  explicit ErrorCovariance(MatrixXd dense)
+      : kind_(Kind::dense), size_(dense.rows()), dense_(std::move(dense)) {
+    if (dense_.rows() != dense_.cols())
+      throw std::invalid_argument("Covariance matrix must be square");
+  }
+
+  static ErrorCovariance identity(Index size) {
+    return ErrorCovariance(Kind::identity, size);
+  }
+
+  static ErrorCovariance diagonal(VectorXd variances) {
+    ErrorCovariance R(Kind::diagonal, variances.size());
+    R.variances_ = std::move(variances);
+    return R;
+  }
+
+  static ErrorCovariance block_diagonal(std::vector<MatrixXd> blocks) {
+    Index size = 0;
+    std::vector<Index> offsets;
+    offsets.reserve(blocks.size());
+    for (const auto &block : blocks) {
+      if (block.rows() != block.cols())
+        throw std::invalid_argument("Covariance blocks must be square");
+      offsets.push_back(size);
+      size += block.rows();
+    }
+    ErrorCovariance R(Kind::block_diagonal, size);
+    R.blocks_ = std::move(blocks);
+    R.offsets_ = std::move(offsets);
+    return R;
+  }
+
+  static ErrorCovariance low_rank(VectorXd variances, MatrixXd factor) {
+    if (factor.rows() != variances.size())
+      throw std::invalid_argument(
+          "Low-rank factor must have one row per observation");
+    ErrorCovariance R(Kind::low_rank, variances.size());
+    R.variances_ = std::move(variances);
+    R.factor_ = std::move(factor);
+    return R;
+  }
+
+  Kind kind() const { return kind_; }
+  Index size() const { return size_; }
+
+  /**
+   * Computes U' * R * U for U of size (size() x k).
+   */
+  MatrixXd project(const MatrixXd &U) const {
+    if (U.rows() != size_)
+      throw std::invalid_argument(
+          "Covariance size does not match the number of observations");
+
+    switch (kind_) {
+    case Kind::identity:
+      return U.transpose() * U;
+    case Kind::diagonal:
+      return U.transpose() * variances_.asDiagonal() * U;
+    case Kind::block_diagonal: {
+      MatrixXd P = MatrixXd::Zero(U.cols(), U.cols());
+      for (std::size_t b = 0; b < blocks_.size(); b++) {
+        const auto U_b = U.middleRows(offsets_[b], blocks_[b].rows());
+        P.noalias() += U_b.transpose() * blocks_[b] * U_b;
+      }
+      return P;
+    }
+    case Kind::low_rank: {
+      MatrixXd FtU = factor_.transpose() * U;
+      MatrixXd P = U.transpose() * variances_.asDiagonal() * U;
+      P.noalias() += FtU.transpose() * FtU;
+      return P;
+    }
+    case Kind::dense:
+    default:
+      return U.transpose() * dense_ * U;
+    }
+  }
+
+  /**
+   * The variances of the observation errors, i.e. the diagonal of R.
+   */
+  VectorXd variances() const {
+    switch (kind_) {
+    case Kind::identity:
+      return VectorXd::Ones(size_);
+    case Kind::diagonal:
+      return variances_;
+    case Kind::block_diagonal: {
+      VectorXd v(size_);
+      for (std::size_t b = 0; b < blocks_.size(); b++)
+        v.segment(offsets_[b], blocks_[b].rows()) = blocks_[b].diagonal();
+      return v;
+    }
+    case Kind::low_rank:
+      return variances_ + factor_.rowwise().squaredNorm();
+    case Kind::dense:
+    default:
+      return dense_.diagonal();
+    }
+  }
+
+  /**
+   * Computes X <- L * X in place, where L * L' = R.
+   *
+   * L is the lower Cholesky factor for the dense and block diagonal forms, so
+   * that the result matches np.linalg.cholesky(R) @ X. For the low-rank form,
+   * with G = diag(variances)^(-1/2) * F = U * Sigma * V', the symmetric factor
+   * L = diag(variances)^(1/2) * (I + U * (sqrt(I + Sigma^2) - I) * U') is
+   * used instead, which costs O(size * rank) per column.
+   */
+  template <typename Scalar> void factor_multiply(MatrixX<Scalar> &X) const {
+    if (X.rows() != size_)
+      throw std::invalid_argument(
+          "Covariance size does not match the number of observations");
+
+    switch (kind_) {
+    case Kind::identity:
+      return;
+    case Kind::diagonal:
+      X = variances_.cwiseSqrt().template cast<Scalar>().asDiagonal() * X;
+      return;
+    case Kind::block_diagonal:
+      for (std::size_t b = 0; b < blocks_.size(); b++) {
+        auto X_b = X.middleRows(offsets_[b], blocks_[b].rows());
+        const MatrixX<Scalar> L = cholesky_factor<Scalar>(blocks_[b]);
+        X_b = L.template triangularView<Eigen::Lower>() * X_b;
+      }
+      return;
+    case Kind::low_rank: {
+      if ((variances_.array() <= 0).any())
+        throw std::invalid_argument(
+            "Low-rank covariance must have positive variances");
+      const VectorXd sd = variances_.cwiseSqrt();
+      const MatrixXd G = sd.cwiseInverse().asDiagonal() * factor_;
+      Eigen::BDCSVD<MatrixXd> svd(G, ComputeThinU);
+      const MatrixX<Scalar> U = svd.matrixU().template cast<Scalar>();
+      const VectorX<Scalar> scale =
+          ((1.0 + svd.singularValues().array().square()).sqrt() - 1.0)
+              .matrix()
+              .template cast<Scalar>();
+      MatrixX<Scalar> UtX = U.transpose() * X;
+      UtX = scale.asDiagonal() * UtX;
+      X.noalias() += U * UtX;
+      X = sd.template cast<Scalar>().asDiagonal() * X;
+      return;
+    }
+    case Kind::dense:
+    default: {
+      const MatrixX<Scalar> L = cholesky_factor<Scalar>(dense_);
+      X = L.template triangularView<Eigen::Lower>() * X;
+      return;
+    }
+    }
+  }
+
+  /**
+   * The covariance of the observations with the given indices, i.e.
+   * R(rows, rows), in the same form as R where possible.
+   */
+  ErrorCovariance select(const IndexVector &rows) const {
+    if (rows.size() > 0 && (rows.minCoeff() < 0 || rows.maxCoeff() >= size_))
+      throw std::invalid_argument("Observation index out of range");
+
+    switch (kind_) {
+    case Kind::identity:
+      return identity(rows.size());
+    case Kind::diagonal:
+      return diagonal(variances_(rows));
+    case Kind::block_diagonal: {
+      /* Observations in different blocks are uncorrelated */
+      std::vector<std::size_t> block(rows.size());
+      for (Index i = 0; i < rows.size(); i++)
+        block[i] = std::upper_bound(offsets_.begin(), offsets_.end(), rows(i)) -
+                   offsets_.begin() - 1;
+      MatrixXd R = MatrixXd::Zero(rows.size(), rows.size());
+      for (Index j = 0; j < rows.size(); j++)
+        for (Index i = 0; i < rows.size(); i++)
+          if (block[i] == block[j])
+            R(i, j) = blocks_[block[i]](rows(i) - offsets_[block[i]],
+                                        rows(j) - offsets_[block[j]]);
+      return ErrorCovariance(std::move(R));
+    }
+    case Kind::low_rank:
+      return low_rank(variances_(rows), factor_(rows, Eigen::all));
+    case Kind::dense:
+    default:
+      return ErrorCovariance(dense_(rows, rows));
+    }
+  }
+
+  /**
+   * diag(scale) * R * diag(scale) in the same form as R, e.g. R scaled by
+   * the inverse observation error standard deviations.
+   */
+  ErrorCovariance scaled(const VectorXd &scale) const {
+    if (scale.size() != size_)
+      throw std::invalid_argument(
+          "scale must have one element per observation");
+
+    switch (kind_) {
+    case Kind::identity:
+      return diagonal(scale.cwiseAbs2());
+    case Kind::diagonal:
+      return diagonal(variances_.cwiseProduct(scale.cwiseAbs2()));
+    case Kind::block_diagonal: {
+      std::vector<MatrixXd> blocks;
+      blocks.reserve(blocks_.size());
+      for (std::size_t b = 0; b < blocks_.size(); b++) {
+        const auto s = scale.segment(offsets_[b], blocks_[b].rows());
+        blocks.push_back(s.asDiagonal() * blocks_[b] * s.asDiagonal());
+      }
+      return block_diagonal(std::move(blocks));
+    }
+    case Kind::low_rank:
+      return low_rank(variances_.cwiseProduct(scale.cwiseAbs2()),
+                      scale.asDiagonal() * factor_);
+    case Kind::dense:
+    default:
+      return ErrorCovariance(scale.asDiagonal() * dense_ * scale.asDiagonal());
+    }
+  }
+
+  MatrixXd to_dense() const {
+    switch (kind_) {
+    case Kind::identity:
+      return MatrixXd::Identity(size_, size_);
+    case Kind::diagonal:
+      return variances_.asDiagonal();
+    case Kind::block_diagonal: {
+      MatrixXd R = MatrixXd::Zero(size_, size_);
+      for (std::size_t b = 0; b < blocks_.size(); b++)
+        R.block(offsets_[b], offsets_[b], blocks_[b].rows(),
+                blocks_[b].cols()) = blocks_[b];
+      return R;
+    }
+    case Kind::low_rank: {
+      MatrixXd R = factor_ * factor_.transpose();
+      R.diagonal() += variances_;
+      return R;
+    }
+    case Kind::dense:
+    default:
+      return dense_;
+    }
+  }
+
+private:
+  ErrorCovariance(Kind kind, Index size) : kind_(kind), size_(size) {}
+
+  template <typename Scalar>
+  static MatrixX<Scalar> cholesky_factor(const MatrixXd &A) {
+    Eigen::LLT<MatrixXd> llt(A);
+    if (llt.info() != Eigen::Success)
+      throw std::invalid_argument("Covariance matrix must be positive definite");
+    const MatrixXd L = llt.matrixL();
+    return L.template cast<Scalar>();
+  }
+
+  Kind kind_;
+  Index size_;
+  VectorXd variances_;
+  MatrixXd factor_;
+  MatrixXd dense_;
+  std::vector<MatrixXd> blocks_;
+  std::vector<Index> offsets_;
+};
+
+inline int calc_num_significant(const VectorXd &singular_values,
+                                double truncation, double total_sigma2) {
+  int num_significant = 0;
+
+  /*
+   * Determine the number of singular values by enforcing that
+   * less than a fraction @truncation of the total variance be
+   * accounted for.
+   */
+  double running_sigma2 = 0;
+  for (auto sig : singular_values) {
+    if (running_sigma2 / total_sigma2 <
+        truncation) { /* Include one more singular value ? */
+      num_significant++;
+      running_sigma2 += sig * sig;
+    } else
+      break;
+  }
+
+  return num_significant;
+}
+
+inline int calc_num_significant(const VectorXd &singular_values,
+                                double truncation) {
+  return calc_num_significant(singular_values, truncation,
+                              singular_values.squaredNorm());
+}
+
+/**
+ * Buffers used by create_coefficient_matrix. nrsig is the number of
+ * significant singular values of S kept by svdS.
+ *
+ * Eigen only reallocates a buffer when the requested size changes, so
+ * passing the same workspace to repeated calls of the same shape avoids the
+ * large (nrobs x nrens) temporaries the algorithm otherwise creates on each
+ * call.
+ */
+template <typename Scalar> struct Workspace {
+  MatrixXd Omega;     /* (nrens x nrens) */
+  MatrixXd C;         /* (nrens x nrens) or (nrens x nrsig) */
+  MatrixXd K;         /* (nrens x nrens) */
+  MatrixX<Scalar> S;  /* (nrobs x nrens) */
+  MatrixX<Scalar> H;  /* (nrobs x nrens) */
+  MatrixX<Scalar> U0; /* (nrobs x nrsig) */
+  VectorXd inv_sig0;  /* (nrsig) */
+  MatrixXd X0;        /* (nrsig x nrens) or (nrsig x nrsig) */
+  MatrixX<Scalar> X1; /* (nrobs x nrsig) */
+  MatrixX<Scalar> X2; /* (nrsig x nrens) */
+  VectorXd eig;       /* (nrsig) */
+  Eigen::BDCSVD<MatrixX<Scalar>> svd_S;
+  Eigen::BDCSVD<MatrixXd> svd_X0;
+  Eigen::LLT<MatrixXd> llt;
+  Eigen::PartialPivLU<MatrixXd> lu;
+};
+
+/* Bytes of a (rows x cols) matrix, for ProfileStage */
+template <typename Scalar> std::size_t matrix_bytes(Index rows, Index cols) {
+  return sizeof(Scalar) * static_cast<std::size_t>(rows * cols);
+}
+
+/**
+ * Estimated flops of the thin SVD of an (m x n) matrix with the left singular
+ * vectors, R-SVD in Golub and Van Loan, Matrix Computations, Section 8.6.
+ */
+inline double thin_svd_flops(double m, double n) {
+  const double k = std::min(m, n);
+  return 6.0 * std::max(m, n) * k * k + 11.0 * k * k * k;
+}
+
+#ifdef EIGEN_USE_LAPACKE
+/**
+ * Thin SVD through LAPACK's divide and conquer driver, sgesdd or dgesdd.
+ * Eigen only forwards JacobiSVD to LAPACKE, so BDCSVD would otherwise run
+ * Eigen's own kernels even when a vendor LAPACK is available.
+ */
+template <typename Scalar>
+void lapacke_thin_svd(const MatrixX<Scalar> &A,
+                      VectorX<Scalar> &singular_values, MatrixX<Scalar> &U) {
+  const lapack_int m = A.rows();
+  const lapack_int n = A.cols();
+  const lapack_int k = std::min(m, n);
+
+  MatrixX<Scalar> work = A; /* gesdd overwrites its input */
+  MatrixX<Scalar> VT(k, n);
+  singular_values.resize(k);
+  U.resize(m, k);
+
+  lapack_int info;
+  if constexpr (std::is_same_v<Scalar, float>)
+    info = LAPACKE_sgesdd(LAPACK_COL_MAJOR, 'S', m, n, work.data(), m,
+                          singular_values.data(), U.data(), m, VT.data(), k);
+  else
+    info = LAPACKE_dgesdd(LAPACK_COL_MAJOR, 'S', m, n, work.data(), m,
+                          singular_values.data(), U.data(), m, VT.data(), k);
+  if (info != 0)
+    throw std::runtime_error("gesdd failed to converge");
+}
+#endif
+
+/**
+ * Orthonormalizes the columns of Q in place.
+ */
+template <typename Scalar> void orthonormalize(MatrixX<Scalar> &Q) {
+  Eigen::HouseholderQR<MatrixX<Scalar>> qr(Q);
+  Q = qr.householderQ() * MatrixX<Scalar>::Identity(Q.rows(), Q.cols());
+}
+
+/**
+ * Randomized range finder SVD, Algorithms 4.4 and 5.1 in Halko, Martinsson
+ * and Tropp, Finding structure with randomness (2011).
+ *
+ * Computes approximations to the leading `rank` singular values of S and the
+ * corresponding left singular vectors in U0 at a cost of
+ * O(nrobs * nrens * rank) instead of O(nrobs * nrens^2). The sketch is
+ * seeded deterministically so repeated calls give the same result.
+ */
+template <typename Scalar>
+void randomized_svd(const MatrixX<Scalar> &S, int rank,
+                    const SolverOptions &options,
+                    VectorX<Scalar> &singular_values, MatrixX<Scalar> &U0,
+                    Eigen::BDCSVD<MatrixX<Scalar>> &svd) {
+  const int nrens = S.cols();
+  const int sketch_size = std::min<int>(rank + options.oversampling,
+                                        std::min(S.rows(), S.cols()));
+
+  /* Drawn in double so both precisions use the same sketch */
+  std::mt19937_64 generator;
+  std::normal_distribution<double> normal;
+  MatrixX<Scalar> G(nrens, sketch_size);
+  for (Index i = 0; i < G.size(); i++)
+    G.data()[i] = static_cast<Scalar>(normal(generator));
+
+  MatrixX<Scalar> Q = S * G;
+  orthonormalize(Q);
+  for (int i = 0; i < options.power_iterations; i++) {
+    G.noalias() = S.transpose() * Q;
+    orthonormalize(G);
+    Q.noalias() = S * G;
+    orthonormalize(Q);
+  }
+
+  /* S ~ Q * Q' * S = Q * U_B * Sigma * V_B' */
+  MatrixX<Scalar> B = Q.transpose() * S;
+  svd.compute(B, ComputeThinU);
+  singular_values = svd.singularValues().head(rank);
+  U0.noalias() = Q * svd.matrixU().leftCols(rank);
+}
+
+/**
+ * Computes the truncated SVD of S. On return U0 holds the num_significant
+ * leading left singular vectors of S and inv_sig0 the inverse of the
+ * corresponding singular values.
+ *
+ * With SVDEngine::randomized a fractional truncation is resolved adaptively:
+ * the sketch is doubled until the singular values found account for the
+ * requested fraction of the total variance, ||S||_F^2.
+ */
+template <typename Scalar, typename Truncation>
+int svdS(const MatrixX<Scalar> &S, Truncation truncation,
+         const SolverOptions &options, VectorXd &inv_sig0,
+         MatrixX<Scalar> &U0, Eigen::BDCSVD<MatrixX<Scalar>> &svd) {
+
+  const int nrmin = std::min(S.rows(), S.cols());
+  int num_significant = 0;
+  VectorX<Scalar> singular_values;
+  ProfileStage stage("svd_S", thin_svd_flops(S.rows(), S.cols()),
+                     2 * matrix_bytes<Scalar>(S.rows(), nrmin));
+
+  if (options.svd_engine == SVDEngine::randomized) {
+    if constexpr (std::is_same_v<Truncation, int>) {
+      num_significant = std::min(truncation, nrmin);
+      randomized_svd(S, num_significant, options, singular_values, U0, svd);
+    } else {
+      const double fraction = truncation;
+      const double total_sigma2 = S.template cast<double>().squaredNorm();
+      int rank = std::min(nrmin, 32);
+      while (true) {
+        randomized_svd(S, rank, options, singular_values, U0, svd);
+        num_significant = calc_num_significant(
+            singular_values.template cast<double>(), fraction, total_sigma2);
+        if (num_significant < rank || rank == nrmin)
+          break;
+        rank = std::min(nrmin, 2 * rank);
+      }
+      U0.conservativeResize(Eigen::NoChange, num_significant);
+      singular_values.conservativeResize(num_significant);
+    }
+  } else {
+#ifdef EIGEN_USE_LAPACKE
+    lapacke_thin_svd(S, singular_values, U0);
+#else
+    svd.compute(S, ComputeThinU);
+    singular_values = svd.singularValues();
+    U0 = svd.matrixU();
+#endif
+
+    if constexpr (std::is_same_v<Truncation, int>)
+      num_significant = std::min(truncation, nrmin);
+    else
+      num_significant = calc_num_significant(
+          singular_values.template cast<double>(), truncation);
+
+    /*
+     * Singular vectors beyond num_significant would be multiplied by zero
+     * in lowrankE and lowrankCinv, so they are dropped here.
+     */
+    U0.conservativeResize(Eigen::NoChange, num_significant);
+    singular_values.conservativeResize(num_significant);
+  }
+
+  inv_sig0 = singular_values.template cast<double>().cwiseInverse();
+
+  return num_significant;
+}
+
+/**
+ Routine computes X1 and eig corresponding to Eqs 14.54-14.55
+ Geir Evensen
+*/
+template <typename Scalar, typename Truncation>
+void lowrankE(
+    const MatrixX<Scalar> &S,                   /* (nrobs x nrens) */
+    const ConstStridedRef<Scalar> &E, /* (nrobs x nrens) */
+    double E_scale,                             /* E is used as E_scale * E */
+    MatrixX<Scalar> &W, /* (nrobs x nrsig) Corresponding to X1 from Eqs.
+                           14.54-14.55 */
+    VectorXd &eig, /* (nrsig) Corresponding to 1 / (1 + Lambda1^2) (14.54) */
+    Truncation truncation, const SolverOptions &options,
+    Workspace<Scalar> &ws) {
+
+  /* Compute SVD of S=HA`  ->  U0, invsig0=sig0^(-1) */
+  const int nrsig =
+      svdS(S, truncation, options, ws.inv_sig0, ws.U0, ws.svd_S);
+  if (nrsig == 0) {
+    /* Nothing is kept, e.g. for constant responses, so K = 0 */
+    W.resize(S.rows(), 0);
+    eig.resize(0);
+    return;
+  }
+  ProfileStage stage("svd_X0",
+                     2.0 * nrsig * E.rows() * E.cols() +
+                         thin_svd_flops(nrsig, E.cols()) +
+                         2.0 * S.rows() * nrsig * nrsig,
+                     2 * matrix_bytes<double>(nrsig, E.cols()) +
+                         matrix_bytes<Scalar>(S.rows(), nrsig));
+
+  /* X0(nrsig x nrens) =  Sigma0^(+) * U0'* E  (14.51)  */
+  with_unit_inner_stride<Scalar>(E, [&](const auto &E_map) {
+    ws.X0.noalias() =
+        (static_cast<Scalar>(E_scale) * ws.U0.transpose() * E_map)
+            .template cast<double>();
+  });
+  ws.X0.array().colwise() *= ws.inv_sig0.array();
+
+  /* Compute SVD of X0->  U1*eig*V1   14.52 */
+  ws.svd_X0.compute(ws.X0, ComputeThinU);
+  const auto &sig1 = ws.svd_X0.singularValues();
+
+  /* Lambda1 = 1/(I + Lambda^2)  in 14.56 */
+  eig.resize(nrsig);
+  for (int i = 0; i < nrsig; i++)
+    eig[i] = 1.0 / (1.0 + sig1[i] * sig1[i]);
+
+  /* Compute X1 = W = U0 * (U1=sig0^+ U1) = U0 * Sigma0^(+') * U1  (14.55) */
+  ws.X0 = ws.svd_X0.matrixU();
+  ws.X0.array().colwise() *= ws.inv_sig0.array();
+  W.noalias() = ws.U0 * ws.X0.template cast<Scalar>();
+}
+
+template <typename Scalar, typename Truncation>
+void lowrankCinv(
+    const MatrixX<Scalar> &S, const ErrorCovariance &R,
+    double R_scale,     /* R is used as R_scale * R */
+    MatrixX<Scalar> &W, /* Corresponding to X1 from Eq. 14.29 */
+    VectorXd &eig,      /* Corresponding to 1 / (1 + Lambda_1) (14.29) */
+    Truncation truncation, const SolverOptions &options,
+    Workspace<Scalar> &ws) {
+
+  const int nrens = S.cols();
+  const int nrsig =
+      svdS(S, truncation, options, ws.inv_sig0, ws.U0, ws.svd_S);
+  if (nrsig == 0) {
+    /* See lowrankE */
+    W.resize(S.rows(), 0);
+    eig.resize(0);
+    return;
+  }
+  /* The cost of projecting R depends on its form, the dense cost is shown */
+  ProfileStage stage("svd_X0",
+                     2.0 * S.rows() * nrsig * (S.rows() + nrsig) +
+                         thin_svd_flops(nrsig, nrsig) +
+                         2.0 * S.rows() * nrsig * nrsig,
+                     2 * matrix_bytes<double>(nrsig, nrsig) +
+                         matrix_bytes<Scalar>(S.rows(), nrsig));
+
+  /* B = Xo = (N-1) * Sigma0^(+) * U0'* Cee * U0 * Sigma0^(+')  (14.26)*/
+  MatrixXd &B = ws.X0;
+  B = R.project(ws.U0.template cast<double>());
+  B *= (nrens - 1.0) * R_scale;
+  B.array().colwise() *= ws.inv_sig0.array();
+  B.array().rowwise() *= ws.inv_sig0.transpose().array();
+
+  ws.svd_X0.compute(B, ComputeThinU);
+  eig = ws.svd_X0.singularValues();
+
+  /* Lambda1 = (I + Lambda)^(-1) */
+  for (int i = 0; i < nrsig; i++)
+    eig[i] = 1.0 / (1 + eig[i]);
+
+  /* Z = Sigma0^(+') * Z */
+  MatrixXd &Z = ws.X0;
+  Z = ws.svd_X0.matrixU();
+  Z.array().colwise() *= ws.inv_sig0.array();
+
+  /* X1 = W = U0 * Z2 = U0 * Sigma0^(+') * Z    */
+  W.noalias() = ws.U0 * Z.template cast<Scalar>();
+}
+
+/**
+ * Sections 3.3 and 3.4, specialized on the subspace inversion type and on
+ * whether truncation is a number of singular values (int) or a fraction of
+ * the variance (double).
+ *
+ * Line 9 uses S' * X3 = (S' * X1) * X2 with X3 = X1 * X2 from Eq. 14.31, so
+ * the (nrobs x nrens) X3 is never formed and the products with nrobs rows
+ * cost O(nrobs * nrens * nrsig) instead of O(nrobs * nrens^2).
+ */
+template <Inversion ies_inversion, typename Scalar, typename Truncation>
+void subspace_inversion(MatrixXd &W, const ConstStridedRef<Scalar> &E,
+                        const ErrorCovariance *R, const MatrixX<Scalar> &S,
+                        const MatrixX<Scalar> &H, Truncation truncation,
+                        double ies_steplength, const SolverOptions &options,
+                        Workspace<Scalar> &ws) {
+  static_assert(ies_inversion != Inversion::exact);
+  const int ens_size = S.cols();
+  const double nsc = 1.0 / sqrt(ens_size - 1.0);
+
+  if constexpr (ies_inversion == Inversion::subspace_re) {
+    lowrankE(S, E, nsc, ws.X1, ws.eig, truncation, options, ws);
+  } else {
+    if (R == nullptr)
+      throw std::invalid_argument("R must be given for EXACT_R inversion");
+    lowrankCinv(S, *R, nsc * nsc, ws.X1, ws.eig, truncation, options, ws);
+  }
+  const int nrsig = ws.X1.cols();
+
+  {
+    /* X2 = (I + Lambda_1)^{-1} * X1' * H, as eig has been transformed */
+    ProfileStage stage("genX3", 2.0 * S.rows() * nrsig * ens_size,
+                       matrix_bytes<Scalar>(nrsig, ens_size));
+    ws.X2.noalias() = ws.X1.transpose() * H;
+    ws.X2.array().colwise() *=
+        ws.eig.head(nrsig).template cast<Scalar>().array();
+  }
+
+  // (Line 9)
+  ProfileStage stage("update",
+                     2.0 * (S.rows() + ens_size) * ens_size * nrsig,
+                     matrix_bytes<double>(ens_size, nrsig));
+  ws.C.noalias() = (S.transpose() * ws.X1).template cast<double>();
+  W *= 1.0 - ies_steplength;
+  W.noalias() += ies_steplength * ws.C * ws.X2.template cast<double>();
+}
+
+/**
+ * Line 9 of Algorithm 1 for the exact inversion, given the lower triangle of
+ * C = S' * S + I in ws.C and S' * H in ws.K. See exact_inversion.
+ */
+template <typename Scalar>
+void solve_exact_inversion(MatrixXd &W, double ies_steplength,
+                           Factorization factorization, Workspace<Scalar> &ws) {
+  if (factorization == Factorization::cholesky) {
+    ws.llt.compute(ws.C);
+    if (ws.llt.info() == Eigen::Success)
+      ws.llt.solveInPlace(ws.K);
+    else
+      factorization = Factorization::svd;
+  }
+
+  if (factorization == Factorization::svd) {
+    ws.C.template triangularView<Eigen::StrictlyUpper>() = ws.C.transpose();
+    auto svd = ws.C.bdcSvd(Eigen::ComputeFullV);
+    ws.X0.noalias() = svd.matrixV().transpose() * ws.K;
+    ws.X0.array().colwise() *= svd.singularValues().cwiseInverse().array();
+    ws.K.noalias() = svd.matrixV() * ws.X0;
+  }
+
+  W *= 1.0 - ies_steplength;
+  W.noalias() += ies_steplength * ws.K;
+}
+
+/**
+ * Section 3.2 - Exact inversion assuming diagonal error covariance matrix
+ *
+ * C = S' * S + I is symmetric positive definite, so by default it is
+ * factorized with Cholesky and applied to S' * H by triangular solves.
+ * Factorization::svd uses a full SVD of C instead, which is slower but more
+ * forgiving when C is badly scaled. Cholesky falls back to the SVD if the
+ * factorization fails.
+ */
+template <typename Scalar>
+void exact_inversion(MatrixXd &W, const MatrixX<Scalar> &S,
+                     const MatrixX<Scalar> &H, double ies_steplength,
+                     Factorization factorization, Workspace<Scalar> &ws) {
+  const int ens_size = S.cols();
+  const double nrobs = S.rows();
+  ProfileStage stage("exact_inversion",
+                     3.0 * nrobs * ens_size * ens_size +
+                         7.0 / 3.0 * ens_size * ens_size * ens_size,
+                     3 * matrix_bytes<double>(ens_size, ens_size));
+
+  /* Only the lower triangle of C is formed */
+  if constexpr (std::is_same_v<Scalar, double>) {
+    ws.C.setIdentity(ens_size, ens_size);
+    ws.C.template selfadjointView<Eigen::Lower>().rankUpdate(S.transpose());
+  } else {
+    MatrixX<Scalar> StS = MatrixX<Scalar>::Zero(ens_size, ens_size);
+    StS.template selfadjointView<Eigen::Lower>().rankUpdate(S.transpose());
+    ws.C = StS.template cast<double>();
+    ws.C.diagonal().array() += 1.0;
+  }
+
+  /* K = C^{-1} * S' * H */
+  ws.K.noalias() = (S.transpose() * H).template cast<double>();
+
+  solve_exact_inversion(W, ies_steplength, factorization, ws);
+}
+
+/**
+ * Solves S * Omega = Y for the average sensitivity matrix S, Line 6 of
+ * Algorithm 1, also Section 5.
+ *
+ * The solve is done from the right with the triangular factors of Omega, so
+ * the (nrobs x nrens) matrix Y is only copied once, into S. With
+ * P * Omega = L * U, S = Y * U^{-1} * L^{-1} * P.
+ */
+template <typename Scalar>
+void solve_omega(const ConstStridedRef<Scalar> &Y,
+                 const SolverOptions &options, Workspace<Scalar> &ws,
+                 const MatrixXd *projection) {
+  const double nrens = Y.cols();
+  {
+    ProfileStage stage("omega_lu", 2.0 / 3.0 * nrens * nrens * nrens,
+                       2 * matrix_bytes<double>(Y.cols(), Y.cols()));
+    ws.lu.compute(ws.Omega);
+  }
+  /* Includes the full pivoting LU when omega_rcond is not met */
+  ProfileStage stage("sensitivity", 2.0 * Y.rows() * nrens * nrens,
+                     matrix_bytes<Scalar>(Y.rows(), Y.cols()));
+  const bool full_pivoting =
+      options.omega_rcond > 0.0 && ws.lu.rcond() < options.omega_rcond;
+
+  if (projection != nullptr) {
+    /*
+     * S = Y * Pi * Omega^{-1} with a single product, where Pi is symmetric
+     * so (Pi * Omega^{-1})' = Omega^{-T} * Pi.
+     */
+    MatrixXd PiOmegaInv;
+    if (full_pivoting)
+      PiOmegaInv =
+          Eigen::FullPivLU<MatrixXd>(ws.Omega).transpose().solve(*projection);
+    else
+      PiOmegaInv = ws.lu.transpose().solve(*projection);
+    const MatrixX<Scalar> M = PiOmegaInv.transpose().template cast<Scalar>();
+    with_unit_inner_stride<Scalar>(
+        Y, [&](const auto &Y_map) { ws.S.noalias() = Y_map * M; });
+    return;
+  }
+
+  ws.S = Y;
+  if (full_pivoting) {
+    /* P * Omega * Q = L * U, S = Y * Q * U^{-1} * L^{-1} * P */
+    Eigen::FullPivLU<MatrixXd> full_lu(ws.Omega);
+    const MatrixX<Scalar> LU = full_lu.matrixLU().template cast<Scalar>();
+    ws.S = ws.S * full_lu.permutationQ();
+    LU.template triangularView<Eigen::Upper>()
+        .template solveInPlace<Eigen::OnTheRight>(ws.S);
+    LU.template triangularView<Eigen::UnitLower>()
+        .template solveInPlace<Eigen::OnTheRight>(ws.S);
+    ws.S = ws.S * full_lu.permutationP();
+    return;
+  }
+
+  const MatrixX<Scalar> LU = ws.lu.matrixLU().template cast<Scalar>();
+  LU.template triangularView<Eigen::Upper>()
+      .template solveInPlace<Eigen::OnTheRight>(ws.S);
+  LU.template triangularView<Eigen::UnitLower>()
+      .template solveInPlace<Eigen::OnTheRight>(ws.S);
+  ws.S = ws.S * ws.lu.permutationP();
+}
+
+/**
+ * Lines 5 and 6 of Algorithm 1. On return ws.S holds the average sensitivity
+ * matrix, which only depends on the observations through the rows of Y.
+ */
+template <typename Scalar>
+void compute_sensitivity(const ConstStridedRef<Scalar> &Y,
+                         const MatrixXd &W, const SolverOptions &options,
+                         Workspace<Scalar> &ws,
+                         const MatrixXd *projection = nullptr) {
+  const int ens_size = Y.cols();
+
+  /* Line 5 of Algorithm 1 */
+  ws.Omega =
+      (1.0 / sqrt(ens_size - 1.0)) * (W.colwise() - W.rowwise().mean());
+  ws.Omega.diagonal().array() += 1.0;
+
+  /* Solving for the average sensitivity matrix.
+     Line 6 of Algorithm 1, also Section 5
+  */
+  solve_omega(Y, options, ws, projection);
+}
+
+/**
+ * The projection Pi = A^+ * A onto the row space of the parameter anomalies
+ * A, Section 2.4.3. It is needed when there are fewer parameters than
+ * realizations and the forward model is non-linear, and is applied as
+ * S = Y * Pi * Omega^{-1} in solve_omega.
+ *
+ * Pi = Q_r * Q_r' from a thin column pivoting QR of A', with r the
+ * numerical rank of A, at a cost of O(num_params * nrens^2). The projection
+ * is only recomputed when the parameter ensemble changes, so passing the
+ * same ensemble in each iteration factorizes it once.
+ */
+class ResponseProjection {
+public:
+  /**
+   * Sets the parameter ensemble, (num_params x nrens). Returns whether the
+   * projection was recomputed.
+   */
+  template <typename Scalar>
+  bool set(const ConstStridedRef<Scalar> &param_ensemble) {
+    if (param_ensemble.cols() < 2)
+      throw std::invalid_argument(
+          "param_ensemble must have at least two realizations");
+    if (param_ensemble_.rows() == param_ensemble.rows() &&
+        param_ensemble_.cols() == param_ensemble.cols() &&
+        param_ensemble_ == param_ensemble.template cast<double>())
+      return false;
+
+    ProfileStage call("response_projection");
+    param_ensemble_ = param_ensemble.template cast<double>();
+    const MatrixXd At = (param_ensemble_.colwise() -
+                         param_ensemble_.rowwise().mean())
+                            .transpose();
+    const Eigen::ColPivHouseholderQR<MatrixXd> qr(At);
+    const Index rank = qr.rank();
+    const MatrixXd Q =
+        qr.householderQ() * MatrixXd::Identity(At.rows(), rank);
+    projection_.noalias() = Q * Q.transpose();
+    return true;
+  }
+
+  void clear() {
+    param_ensemble_.resize(0, 0);
+    projection_.resize(0, 0);
+  }
+
+  /* The projection, or nullptr if no parameter ensemble is set */
+  const MatrixXd *matrix() const {
+    return projection_.size() > 0 ? &projection_ : nullptr;
+  }
+
+private:
+  MatrixXd param_ensemble_; /* (num_params x nrens) */
+  MatrixXd projection_;     /* (nrens x nrens) */
+};
+
+/**
+ * Lines 7 to 9 of Algorithm 1, given the average sensitivity matrix in ws.S.
+ * See dispatch_inversion for the template parameters.
+ */
+template <Inversion ies_inversion, typename Scalar, typename Truncation>
+void update_from_sensitivity(const ErrorCovariance *R,
+                             const ConstStridedRef<Scalar> &E,
+                             const ConstStridedRef<Scalar> &D,
+                             Truncation truncation, MatrixXd &W,
+                             double ies_steplength,
+                             const SolverOptions &options,
+                             Workspace<Scalar> &ws) {
+  /* Similar to the innovation term.
+     Differs in that `D` here is defined as dobs + E - Y instead of just dobs +
+     E as in the paper. Line 7 of Algorithm 1, also Section 2.6
+  */
+  {
+    ProfileStage stage("innovation", 2.0 * D.rows() * D.cols() * D.cols(),
+                       matrix_bytes<Scalar>(D.rows(), D.cols()));
+    ws.H = D;
+    ws.H.noalias() += ws.S * W.template cast<Scalar>();
+  }
+
+  /*
+   * With R=I the subspace inversion (ies_inversion=1) with
+   * singular value trucation=1.000 gives exactly the same solution as the exact
+   * inversion (`ies_inversion`=Inversion::exact).
+   *
+   * With very large data sets it is likely that the inversion becomes poorly
+   * conditioned and a trucation=1.0 is not a good choice. In this case
+   * `ies_inversion` other than Inversion::exact and truncation set to less
+   * than 1.0 could stabilize the algorithm.
+   */
+
+  if constexpr (ies_inversion == Inversion::exact)
+    exact_inversion(W, ws.S, ws.H, ies_steplength, options.factorization, ws);
+  else
+    subspace_inversion<ies_inversion, Scalar>(W, E, R, ws.S, ws.H, truncation,
+                                              ies_steplength, options, ws);
+}
+
+/**
+ * Calls f(std::integral_constant<Inversion, ies_inversion>(), t) where t is
+ * truncation as an int or a double. The kernels are specialized on both, so
+ * the choice is made once per call rather than in each helper, e.g. once
+ * for all the observation subsets of create_coefficient_matrices.
+ */
+template <typename F>
+void dispatch_inversion(const Inversion ies_inversion,
+                        const std::variant<double, int> &truncation, F &&f) {
+  std::visit(
+      [&](auto t) {
+        switch (ies_inversion) {
+        case Inversion::exact:
+          return f(std::integral_constant<Inversion, Inversion::exact>(), t);
+        case Inversion::subspace_exact_r:
+          return f(std::integral_constant<Inversion,
+                                          Inversion::subspace_exact_r>(),
+                   t);
+        case Inversion::subspace_re:
+          return f(
+              std::integral_constant<Inversion, Inversion::subspace_re>(), t);
+        }
+        throw std::invalid_argument("Unknown inversion type");
+      },
+      truncation);
+}
+
+/**
+ * @brief Computer coefficient matrix (W) following steps 4-8
+ * of Algorithm 1.
+ *
+ * W = W - ies_steplength * (W - S' * (S * S' + R)^{-1} * H)
+ * When R=I Line 9 can be rewritten as
+ * W = W - ies_steplength * ( W - (S'*S + I)^{-1} * S' * H )
+ * Notice the expression being inverted.
+ * Instead of S * S' which is a (num_obs, num_obs) sized matrix,
+ * we get S' * S which is of size (ensemble_size, ensemble_size).
+ * This is great since num_obs is usually much larger than ensemble_size.
+ *
+ * @param Y Predicted ensemble anomalies normalized by sqrt(N-1),
+ *          where N is the number of realizations.
+ *          See line 4 of Algorithm 1 and Eq. 30.
+ * @param R Observation error covariance, scaled by the observation error
+ *          standard deviations. Only used by Inversion::subspace_exact_r.
+ * @param options Numerical methods to use, see SolverOptions.
+ * @param ws Buffers for intermediate results, see Workspace.
+ * @param projection Projection of the responses onto the row space of the
+ *          parameter anomalies, see ResponseProjection. Not applied if null.
+ */
+template <typename Scalar>
+void create_coefficient_matrix(const ConstStridedRef<Scalar> &Y,
+                               const ErrorCovariance *R,
+                               const ConstStridedRef<Scalar> &E,
+                               const ConstStridedRef<Scalar> &D,
+                               const Inversion ies_inversion,
+                               const std::variant<double, int> &truncation,
+                               MatrixXd &W, double ies_steplength,
+                               const SolverOptions &options,
+                               Workspace<Scalar> &ws,
+                               const MatrixXd *projection = nullptr) {
+  ProfileStage call("create_coefficient_matrix");
+  compute_sensitivity(Y, W, options, ws, projection);
+  dispatch_inversion(ies_inversion, truncation, [&](auto inversion, auto t) {
+    update_from_sensitivity<decltype(inversion)::value, Scalar>(
+        R, E, D, t, W, ies_steplength, options, ws);
+  });
+}
+
+/**
+ * Computes one coefficient matrix per subset of the observations, as
+ * create_coefficient_matrix would for the rows of Y, E, D and R in each
+ * subset, e.g. for distance based localization.
+ *
+ * Omega only depends on W, so S is computed once for all observations and
+ * each subset uses its rows of S. The subsets are processed in parallel,
+ * with dynamic scheduling since their sizes may vary a lot. A subset of
+ * consecutive observations uses E and D without copying.
+ */
+template <typename Scalar>
+std::vector<MatrixXd> create_coefficient_matrices(
+    const ConstStridedRef<Scalar> &Y, const ErrorCovariance *R,
+    const ConstStridedRef<Scalar> &E,
+    const ConstStridedRef<Scalar> &D, const Inversion ies_inversion,
+    const std::variant<double, int> &truncation, const MatrixXd &W,
+    double ies_steplength, const std::vector<IndexVector> &observation_subsets,
+    const SolverOptions &options) {
+  const Index nobs = Y.rows();
+  if (E.rows() != nobs || D.rows() != nobs)
+    throw std::invalid_argument("Y, E and D must have the same number of rows");
+  if (E.cols() != Y.cols() || D.cols() != Y.cols())
+    throw std::invalid_argument(
+        "Y, E and D must have one column per realization");
+  if (ies_inversion == Inversion::subspace_exact_r && R == nullptr)
+    throw std::invalid_argument("R must be given for EXACT_R inversion");
+  if (R != nullptr && R->size() != nobs)
+    throw std::invalid_argument(
+        "Covariance size does not match the number of observations");
+  for (const auto &rows : observation_subsets)
+    if (rows.size() > 0 && (rows.minCoeff() < 0 || rows.maxCoeff() >= nobs))
+      throw std::invalid_argument("Observation index out of range");
+
+  ProfileStage call("create_coefficient_matrices");
+  const std::uint64_t profile_call = ProfileStage::current_call();
+  Workspace<Scalar> shared;
+  compute_sensitivity(Y, W, options, shared);
+  const MatrixX<Scalar> &S = shared.S;
+
+  const Index num_subsets = observation_subsets.size();
+  std::vector<MatrixXd> coefficient_matrices(num_subsets);
+
+  dispatch_inversion(ies_inversion, truncation, [&](auto inversion, auto t) {
+    constexpr Inversion inv = decltype(inversion)::value;
+    /* E is only used by subspace_re and R by subspace_exact_r */
+    constexpr bool use_E = inv == Inversion::subspace_re;
+    constexpr bool use_R = inv == Inversion::subspace_exact_r;
+
+    /*
+     * An exception must not leave the parallel region, so the first one is
+     * rethrown after it
+     */
+    std::exception_ptr error;
+    IES_OMP(parallel num_threads(Eigen::nbThreads()))
+    {
+      ProfileThread profile_thread(profile_call);
+      Workspace<Scalar> ws;
+      MatrixX<Scalar> E_rows, D_rows;
+      IES_OMP(for schedule(dynamic))
+      for (Index i = 0; i < num_subsets; i++) {
+        try {
+          const IndexVector &rows = observation_subsets[i];
+          const Index k = rows.size();
+          MatrixXd &W_i = coefficient_matrices[i];
+          W_i = W;
+
+          const bool consecutive =
+              k > 0 && rows(k - 1) - rows(0) == k - 1 &&
+              (rows.tail(k - 1) - rows.head(k - 1)).cwiseEqual(1).all();
+          std::optional<ErrorCovariance> R_rows;
+          if constexpr (use_R)
+            R_rows = R->select(rows);
+          if (consecutive) {
+            ws.S = S.middleRows(rows(0), k);
+            update_from_sensitivity<inv, Scalar>(
+                R_rows ? &*R_rows : nullptr, E.middleRows(rows(0), k),
+                D.middleRows(rows(0), k), t, W_i, ies_steplength, options, ws);
+          } else {
+            ws.S = S(rows, Eigen::all);
+            if constexpr (use_E)
+              E_rows = E(rows, Eigen::all);
+            D_rows = D(rows, Eigen::all);
+            update_from_sensitivity<inv, Scalar>(R_rows ? &*R_rows : nullptr,
+                                                 E_rows, D_rows, t, W_i,
+                                                 ies_steplength, options, ws);
+          }
+        } catch (...) {
+          IES_OMP(critical(ies_create_coefficient_matrices))
+          if (!error)
+            error = std::current_exception();
+        }
+      }
+    }
+    if (error)
+      std::rethrow_exception(error);
+  });
+
+  return coefficient_matrices;
+}
+
+/**
+ * Compresses the observations to at most nrens rows, without changing the
+ * coefficient matrix of create_coefficient_matrix, e.g. for combining the
+ * observations of several processes.
+ *
+ * With the thin QR factorization Y = Q * T, the compressed observations are
+ *
+ *   Y_c = T, E_c = Q' * E, D_c = Q' * D, R_c = Q' * R * Q.
+ *
+ * Then S_c = Q' * S and H_c = Q' * H, so S_c' * S_c and S_c' * H_c, the
+ * singular values of S_c and the projections of H, E and R onto its left
+ * singular vectors all equal those of the full observations, and every
+ * inversion gives the same W up to rounding. The parts of D and E outside
+ * the range of Y never enter W.
+ *
+ * Compressing the observations stacked from compressed blocks, with R_c of
+ * the blocks as the diagonal blocks of R, gives the compression of all the
+ * observations when the errors of different blocks are uncorrelated, so the
+ * compression can be applied as a tree reduction.
+ *
+ * Returns Y_c, R_c, E_c and D_c, with R_c only if R is given.
+ */
+template <typename Scalar>
+std::tuple<MatrixX<Scalar>, std::optional<MatrixXd>, MatrixX<Scalar>,
+           MatrixX<Scalar>>
+compress_observations(const ConstStridedRef<Scalar> &Y,
+                      const ErrorCovariance *R,
+                      const ConstStridedRef<Scalar> &E,
+                      const ConstStridedRef<Scalar> &D) {
+  const Index nobs = Y.rows();
+  const Index ens_size = Y.cols();
+  if (E.rows() != nobs || D.rows() != nobs)
+    throw std::invalid_argument("Y, E and D must have the same number of rows");
+  if (E.cols() != ens_size || D.cols() != ens_size)
+    throw std::invalid_argument(
+        "Y, E and D must have one column per realization");
+  if (R != nullptr && R->size() != nobs)
+    throw std::invalid_argument(
+        "Covariance size does not match the number of observations");
+  const Index k = std::min(nobs, ens_size);
+  /* The QR and applying Q' to E and D */
+  ProfileStage call("compress_observations",
+                    10.0 * nobs * ens_size * ens_size,
+                    2 * matrix_bytes<Scalar>(nobs, ens_size));
+
+  const Eigen::HouseholderQR<MatrixX<Scalar>> qr(Y);
+  MatrixX<Scalar> Y_c = qr.matrixQR().topRows(k);
+  Y_c.template triangularView<Eigen::StrictlyLower>().setZero();
+
+  /* Q' * E and Q' * D without forming Q */
+  const auto project = [&](const ConstStridedRef<Scalar> &X) {
+    MatrixX<Scalar> QtX = X;
+    QtX.applyOnTheLeft(qr.householderQ().adjoint());
+    return MatrixX<Scalar>(QtX.topRows(k));
+  };
+
+  std::optional<MatrixXd> R_c;
+  if (R != nullptr) {
+    const MatrixX<Scalar> Q =
+        qr.householderQ() * MatrixX<Scalar>::Identity(nobs, k);
+    R_c = R->project(Q.template cast<double>());
+  }
+  return {std::move(Y_c), std::move(R_c), project(E), project(D)};
+}
+
+/**
+ * Accumulates the (nrens x nrens) products Y' * Y and Y' * D over blocks of
+ * observations, so that the exact inversion does not need all of Y and D at
+ * once.
+ *
+ * With S = Y * Omega^{-1} and H = D + S * W, the exact inversion only uses
+ *
+ *   S' * S = Omega^{-T} * Y' * Y * Omega^{-1},
+ *   S' * H = Omega^{-T} * Y' * D + S' * S * W,
+ *
+ * so update gives the W of create_coefficient_matrix with Inversion::exact,
+ * up to rounding, in O(nrens^2) memory. Y and D are scaled and centered row
+ * by row, so each block can be prepared on its own. The products are
+ * accumulated in double also for float blocks.
+ */
+class GramAccumulator {
+public:
+  explicit GramAccumulator(Index ensemble_size)
+      : YtY_(MatrixXd::Zero(ensemble_size, ensemble_size)),
+        YtD_(MatrixXd::Zero(ensemble_size, ensemble_size)) {}
+
+  /**
+   * Adds the observations in the rows of Y and D.
+   */
+  template <typename Scalar>
+  void add(const ConstStridedRef<Scalar> &Y, const ConstStridedRef<Scalar> &D) {
+    const Index ens_size = ensemble_size();
+    if (Y.cols() != ens_size || D.cols() != ens_size)
+      throw std::invalid_argument(
+          "Y and D must have one column per realization");
+    if (Y.rows() != D.rows())
+      throw std::invalid_argument("Y and D must have the same number of rows");
+    ProfileStage call("gram_add", 3.0 * Y.rows() * ens_size * ens_size);
+
+    with_unit_inner_stride<Scalar>(Y, [&](const auto &Y_map) {
+      with_unit_inner_stride<Scalar>(D, [&](const auto &D_map) {
+        /* Only the lower triangle of Y' * Y is formed */
+        if constexpr (std::is_same_v<Scalar, double>) {
+          YtY_.selfadjointView<Eigen::Lower>().rankUpdate(Y_map.transpose());
+          YtD_.noalias() += Y_map.transpose() * D_map;
+        } else {
+          MatrixX<Scalar> YtY = MatrixX<Scalar>::Zero(ens_size, ens_size);
+          YtY.template selfadjointView<Eigen::Lower>().rankUpdate(
+              Y_map.transpose());
+          YtY_ += YtY.template cast<double>();
+          YtD_ += (Y_map.transpose() * D_map).template cast<double>();
+        }
+      });
+    });
+    num_observations_ += Y.rows();
+  }
+
+  /**
+   * Lines 5 to 9 of Algorithm 1 with the exact inversion, from the blocks
+   * added so far. See create_coefficient_matrix.
+   */
+  void update(MatrixXd &W, double ies_steplength, const SolverOptions &options,
+              Workspace<double> &ws) const {
+    const Index ens_size = ensemble_size();
+    if (W.rows() != ens_size || W.cols() != ens_size)
+      throw std::invalid_argument(
+          "W must have one row and column per realization");
+
+    ProfileStage call("gram_update");
+
+    /* Line 5 of Algorithm 1 */
+    ws.Omega =
+        (1.0 / sqrt(ens_size - 1.0)) * (W.colwise() - W.rowwise().mean());
+    ws.Omega.diagonal().array() += 1.0;
+
+    ws.lu.compute(ws.Omega);
+    if (options.omega_rcond > 0.0 && ws.lu.rcond() < options.omega_rcond)
+      gram_products(Eigen::FullPivLU<MatrixXd>(ws.Omega), W, ws);
+    else
+      gram_products(ws.lu, W, ws);
+
+    solve_exact_inversion(W, ies_steplength, options.factorization, ws);
+  }
+
+  void reset() {
+    YtY_.setZero();
+    YtD_.setZero();
+    num_observations_ = 0;
+  }
+
+  Index ensemble_size() const { return YtY_.rows(); }
+  Index num_observations() const { return num_observations_; }
+
+private:
+  /**
+   * Sets ws.C = S' * S + I and ws.K = S' * H, given a factorization of
+   * Omega.
+   */
+  template <typename LU>
+  void gram_products(const LU &lu, const MatrixXd &W,
+                     Workspace<double> &ws) const {
+    /* S' * S = Omega^{-T} * (Omega^{-T} * Y' * Y)' as Y' * Y is symmetric */
+    ws.K = lu.transpose().solve(
+        MatrixXd(YtY_.selfadjointView<Eigen::Lower>()));
+    ws.C = lu.transpose().solve(ws.K.transpose());
+    ws.K = lu.transpose().solve(YtD_);
+    ws.K.noalias() += ws.C * W;
+    ws.C.diagonal().array() += 1.0;
+  }
+
+  MatrixXd YtY_;
+  MatrixXd YtD_;
+  Index num_observations_ = 0;
+};
+
+/**
+ * The factorizations of create_coefficient_matrix that do not depend on the
+ * step length or the truncation, for trying several of them cheaply.
+ *
+ * The step length only enters Line 9 of Algorithm 1, W <- (1 - step) * W +
+ * step * K, so K is computed once per truncation. The exact inversion does
+ * not use the truncation. The subspace inversions keep the thin SVD
+ * S = U * Sigma * V' and project H, and E or R, onto U once. Then with
+ * X1 = U_k * Sigma_k^{-1} * U1 from lowrankE or lowrankCinv,
+ *
+ *   K = S' * X1 * diag(eig) * X1' * H
+ *     = V_k * U1 * diag(eig) * U1' * Sigma_k^{-1} * U_k' * H,
+ *
+ * which only involves (nrens x nrens) matrices, so that each truncation
+ * costs O(nrens^2 * k) instead of O(nrobs * nrens^2).
+ *
+ * The SVD of S is always computed exactly, options.svd_engine is not used.
+ */
+class CoefficientMatrixFactors {
+public:
+  /**
+   * Factorizes the update of W, see create_coefficient_matrix.
+   */
+  template <typename Scalar>
+  CoefficientMatrixFactors(const ConstStridedRef<Scalar> &Y,
+                           const ErrorCovariance *R,
+                           const ConstStridedRef<Scalar> &E,
+                           const ConstStridedRef<Scalar> &D,
+                           const Inversion ies_inversion, const MatrixXd &W,
+                           const SolverOptions &options,
+                           const MatrixXd *projection = nullptr)
+      : inversion_(ies_inversion), W_(W) {
+    if (ies_inversion == Inversion::subspace_exact_r && R == nullptr)
+      throw std::invalid_argument("R must be given for EXACT_R inversion");
+    const Index ens_size = Y.cols();
+    ProfileStage call("factorize_coefficient_matrix");
+
+    Workspace<Scalar> ws;
+    compute_sensitivity(Y, W, options, ws, projection);
+    {
+      ProfileStage stage("innovation", 2.0 * D.rows() * ens_size * ens_size,
+                         matrix_bytes<Scalar>(D.rows(), ens_size));
+      ws.H = D;
+      ws.H.noalias() += ws.S * W.template cast<Scalar>();
+    }
+
+    if (ies_inversion == Inversion::exact) {
+      /* With W = 0 and a step length of 1 exact_inversion gives K */
+      K_.setZero(ens_size, ens_size);
+      exact_inversion(K_, ws.S, ws.H, 1.0, options.factorization, ws);
+      return;
+    }
+
+    ProfileStage stage("svd_S", thin_svd_flops(Y.rows(), ens_size),
+                       2 * matrix_bytes<Scalar>(Y.rows(), ens_size));
+    ws.svd_S.compute(ws.S, ComputeThinU | ComputeThinV);
+    singular_values_ = ws.svd_S.singularValues().template cast<double>();
+    V_ = ws.svd_S.matrixV().template cast<double>();
+    const auto &U = ws.svd_S.matrixU();
+    UtH_ = (U.transpose() * ws.H).template cast<double>();
+
+    const double nsc = 1.0 / sqrt(ens_size - 1.0);
+    if (ies_inversion == Inversion::subspace_re) {
+      with_unit_inner_stride<Scalar>(E, [&](const auto &E_map) {
+        UtE_ = (static_cast<Scalar>(nsc) * U.transpose() * E_map)
+                   .template cast<double>();
+      });
+    } else {
+      /* (N - 1) * nsc^2 * U' * R * U, see lowrankCinv */
+      UtRU_ = R->project(U.template cast<double>());
+    }
+  }
+
+  /**
+   * The factors of the update of W = 0 from the thin SVD S = U * Sigma * V'
+   * and the projections U' * H, nsc * U' * E (subspace_re) and U' * R * U
+   * (subspace_exact_r), see ensemble_smoother_sweep.
+   */
+  CoefficientMatrixFactors(const Inversion ies_inversion,
+                           VectorXd singular_values, MatrixXd V, MatrixXd UtH,
+                           MatrixXd UtE, MatrixXd UtRU)
+      : inversion_(ies_inversion), W_(MatrixXd::Zero(V.rows(), V.rows())),
+        singular_values_(std::move(singular_values)), V_(std::move(V)),
+        UtH_(std::move(UtH)), UtE_(std::move(UtE)), UtRU_(std::move(UtRU)) {
+    if (ies_inversion == Inversion::exact) {
+      /* (S' * S + I)^{-1} * S' = V * (Sigma^2 + I)^{-1} * Sigma * U' */
+      const VectorXd s = singular_values_;
+      K_ = V_ * (s.array() / (1.0 + s.array().square())).matrix().asDiagonal() *
+           UtH_;
+    }
+  }
+
+  /**
+   * K in Line 9 of Algorithm 1 for the given truncation.
+   */
+  MatrixXd update_direction(const std::variant<double, int> &truncation) const {
+    if (inversion_ == Inversion::exact)
+      return K_;
+
+    const int nrmin = singular_values_.size();
+    const int nrsig =
+        std::holds_alternative<int>(truncation)
+            ? std::min(std::get<int>(truncation), nrmin)
+            : calc_num_significant(singular_values_,
+                                   std::get<double>(truncation));
+    if (nrsig == 0)
+      return MatrixXd::Zero(V_.rows(), V_.rows());
+    const VectorXd inv_sig0 = singular_values_.head(nrsig).cwiseInverse();
+
+    Eigen::BDCSVD<MatrixXd> svd;
+    VectorXd eig(nrsig);
+    if (inversion_ == Inversion::subspace_re) {
+      /* Eqs. 14.51 to 14.56, see lowrankE */
+      svd.compute(inv_sig0.asDiagonal() * UtE_.topRows(nrsig), ComputeThinU);
+      const auto &sig1 = svd.singularValues();
+      for (int i = 0; i < nrsig; i++)
+        eig[i] = 1.0 / (1.0 + sig1[i] * sig1[i]);
+    } else {
+      /* Eq. 14.26, see lowrankCinv */
+      svd.compute(inv_sig0.asDiagonal() *
+                      UtRU_.topLeftCorner(nrsig, nrsig) *
+                      inv_sig0.asDiagonal(),
+                  ComputeThinU);
+      for (int i = 0; i < nrsig; i++)
+        eig[i] = 1.0 / (1.0 + svd.singularValues()[i]);
+    }
+
+    const MatrixXd &U1 = svd.matrixU();
+    MatrixXd X1tH =
+        U1.transpose() * inv_sig0.asDiagonal() * UtH_.topRows(nrsig);
+    X1tH = eig.asDiagonal() * X1tH;
+    return V_.leftCols(nrsig) * (U1 * X1tH);
+  }
+
+  /**
+   * The W create_coefficient_matrix returns for the given truncation and
+   * step length.
+   */
+  MatrixXd coefficient_matrix(const std::variant<double, int> &truncation,
+                              double ies_steplength) const {
+    MatrixXd W = (1.0 - ies_steplength) * W_;
+    W.noalias() += ies_steplength * update_direction(truncation);
+    return W;
+  }
+
+  /**
+   * coefficient_matrix for each step length, with K computed once.
+   */
+  std::vector<MatrixXd>
+  coefficient_matrices(const std::variant<double, int> &truncation,
+                       const std::vector<double> &ies_steplengths) const {
+    const MatrixXd K = update_direction(truncation);
+    std::vector<MatrixXd> coefficient_matrices;
+    coefficient_matrices.reserve(ies_steplengths.size());
+    for (double step : ies_steplengths)
+      coefficient_matrices.push_back((1.0 - step) * W_ + step * K);
+    return coefficient_matrices;
+  }
+
+  /**
+   * I + W / sqrt(N - 1) for the W of coefficient_matrix.
+   */
+  MatrixXd transition_matrix(const std::variant<double, int> &truncation,
+                             double ies_steplength) const {
+    MatrixXd T = coefficient_matrix(truncation, ies_steplength) /
+                 sqrt(ensemble_size() - 1.0);
+    T.diagonal().array() += 1.0;
+    return T;
+  }
+
+  /* The coefficient matrix the factors were computed for */
+  const MatrixXd &initial_coefficient_matrix() const { return W_; }
+  Index ensemble_size() const { return W_.rows(); }
+  Inversion inversion() const { return inversion_; }
+
+private:
+  Inversion inversion_;
+  MatrixXd W_;
+  MatrixXd K_;               /* (nrens x nrens), exact inversion */
+  VectorXd singular_values_; /* (nrmin) */
+  MatrixXd V_;               /* (nrens x nrmin) */
+  MatrixXd UtH_;             /* (nrmin x nrens) */
+  MatrixXd UtE_;             /* (nrmin x nrens), subspace_re */
+  MatrixXd UtRU_;            /* (nrmin x nrmin), subspace_exact_r */
+};
+
+/**
+ * The coefficient matrices of one step from W = 0 with a step length of 1,
+ * as create_coefficient_matrix, for several inflations of the observation
+ * errors and realizations of the noise of the same responses, e.g. for
+ * ES-MDA or for screening weightings of the observations.
+ *
+ * Inflating the error covariance by alpha divides S and the innovations
+ * D0 = D - E by sqrt(alpha), and leaves E and the scaled R unchanged. So the
+ * thin SVD of S is computed once, a case only adds U' * E for its noise, and
+ * the (nrens x nrens) solves of the cases run in parallel.
+ *
+ * @param D0 The scaled innovations without noise, (d - y) / sd.
+ * @param E The scaled noise of each case. A single E is used for all cases.
+ * @param inflations The inflation of the error covariance of each case. A
+ *          single inflation is used for all cases.
+ */
+template <typename Scalar>
+std::vector<MatrixXd> ensemble_smoother_sweep(
+    const ConstStridedRef<Scalar> &Y, const ErrorCovariance *R,
+    const ConstStridedRef<Scalar> &D0, const std::vector<MatrixX<Scalar>> &E,
+    const std::vector<double> &inflations, const Inversion ies_inversion,
+    const std::variant<double, int> &truncation) {
+  const Index nobs = Y.rows();
+  const Index ens_size = Y.cols();
+  if (E.empty() || inflations.empty())
+    throw std::invalid_argument("E and inflations must not be empty");
+  if (E.size() != 1 && inflations.size() != 1 &&
+      E.size() != inflations.size())
+    throw std::invalid_argument(
+        "E and inflations must have the same length or length one");
+  if (D0.rows() != nobs || D0.cols() != ens_size)
+    throw std::invalid_argument("D0 must have the same shape as Y");
+  for (const auto &E_k : E)
+    if (E_k.rows() != nobs || E_k.cols() != ens_size)
+      throw std::invalid_argument("Each E must have the same shape as Y");
+  for (double alpha : inflations)
+    if (!(alpha > 0.0))
+      throw std::invalid_argument("Inflations must be positive");
+  if (ies_inversion == Inversion::subspace_exact_r && R == nullptr)
+    throw std::invalid_argument("R must be given for EXACT_R inversion");
+
+  ProfileStage call("ensemble_smoother_sweep");
+  const std::uint64_t profile_call = ProfileStage::current_call();
+  Eigen::BDCSVD<MatrixX<Scalar>> svd;
+  {
+    ProfileStage stage("svd_S", thin_svd_flops(nobs, ens_size),
+                       2 * matrix_bytes<Scalar>(nobs, ens_size));
+    svd.compute(Y, ComputeThinU | ComputeThinV);
+  }
+  const VectorXd singular_values = svd.singularValues().template cast<double>();
+  const MatrixXd V = svd.matrixV().template cast<double>();
+  const MatrixX<Scalar> &U = svd.matrixU();
+  const MatrixXd UtD0 = (U.transpose() * D0).template cast<double>();
+  MatrixXd UtRU;
+  if (ies_inversion == Inversion::subspace_exact_r)
+    UtRU = R->project(U.template cast<double>());
+
+  const Index num_noise = E.size();
+  const Index num_cases = std::max(E.size(), inflations.size());
+  const double nsc = 1.0 / sqrt(ens_size - 1.0);
+  std::vector<MatrixXd> UtE(num_noise);
+  std::vector<MatrixXd> coefficient_matrices(num_cases);
+
+  IES_OMP(parallel num_threads(Eigen::nbThreads()))
+  {
+    ProfileThread profile_thread(profile_call);
+    IES_OMP(for schedule(dynamic))
+    for (Index k = 0; k < num_noise; k++) {
+      ProfileStage stage("project_noise", 2.0 * nobs * ens_size * ens_size,
+                         matrix_bytes<double>(ens_size, ens_size));
+      UtE[k] = (U.transpose() * E[k]).template cast<double>();
+    }
+
+    IES_OMP(for schedule(dynamic))
+    for (Index i = 0; i < num_cases; i++) {
+      const MatrixXd &UtE_i = UtE[num_noise == 1 ? 0 : i];
+      const double scale =
+          1.0 / sqrt(inflations[inflations.size() == 1 ? 0 : i]);
+      /* U' * H = U' * (D0 + E) with W = 0 */
+      const CoefficientMatrixFactors factors(
+          ies_inversion, scale * singular_values, V, scale * UtD0 + UtE_i,
+          ies_inversion == Inversion::subspace_re ? MatrixXd(nsc * UtE_i)
+                                                  : MatrixXd(),
+          UtRU);
+      coefficient_matrices[i] = factors.update_direction(truncation);
+    }
+  }
+  return coefficient_matrices;
+}
+
+/**
+ * Computes D = d + E - S into D, which may be E itself.
+ */
+template <typename Scalar>
+void makeD(const VectorXd &obs_values, const ConstStridedRef<Scalar> &E,
+           const ConstStridedRef<Scalar> &S, StridedRef<Scalar> D) {
+  if (E.rows() != S.rows() || E.cols() != S.cols())
+    throw std::invalid_argument("E and S must have the same shape");
+  if (obs_values.size() != E.rows())
+    throw std::invalid_argument(
+        "obs_values must have one element per row of E");
+  if (D.rows() != E.rows() || D.cols() != E.cols())
+    throw std::invalid_argument("D must have the same shape as E");
+
+  const VectorX<Scalar> d = obs_values.template cast<Scalar>();
+  for (Index j = 0; j < E.cols(); j++)
+    D.col(j) = E.col(j) - S.col(j) + d;
+}
+
+template <typename Scalar>
+MatrixX<Scalar> makeD(const VectorXd &obs_values,
+                      const ConstStridedRef<Scalar> &E,
+                      const ConstStridedRef<Scalar> &S) {
+  MatrixX<Scalar> D(E.rows(), E.cols());
+  makeD<Scalar>(obs_values, E, S, D);
+  return D;
+}
+
+/**
+ * Fills column j of Z with standard normal samples drawn from a generator
+ * seeded by (seed, j), so that the result does not depend on the number of
+ * threads. The samples are drawn in double, so both precisions see the same
+ * noise up to rounding.
+ */
+template <typename Scalar>
+void standard_normal(MatrixX<Scalar> &Z, std::uint64_t seed) {
+  IES_OMP(parallel for num_threads(Eigen::nbThreads()))
+  for (Index j = 0; j < Z.cols(); j++) {
+    const auto col = static_cast<std::uint64_t>(j);
+    std::seed_seq seq{static_cast<std::uint32_t>(seed),
+                      static_cast<std::uint32_t>(seed >> 32),
+                      static_cast<std::uint32_t>(col),
+                      static_cast<std::uint32_t>(col >> 32)};
+    std::mt19937_64 generator(seq);
+    std::normal_distribution<double> normal;
+    for (Index i = 0; i < Z.rows(); i++)
+      Z(i, j) = static_cast<Scalar>(normal(generator));
+  }
+}
+
+/**
+ * Perturbs the observations, returning the scaled E and D used by
+ * create_coefficient_matrix, and the scaled anomalies Y of S if Y is given.
+ *
+ * The columns of E are sampled from N(0, C) and centered, Evensen 2019, and
+ * D = d + E - S. Both are then divided row-wise by `scale`, which defaults to
+ * the observation error standard deviations sqrt(diag(C)). Y is S centered,
+ * divided row-wise by `scale` and by sqrt(N - 1), Eq. 30.
+ *
+ * Besides the row means, the outputs are formed in one pass over the
+ * columns, so each column of S, E and D is read once while it is in cache.
+ *
+ * @param noise Standard normal samples of size (nobs x N). If not given they
+ *        are drawn with standard_normal using `seed`, or a random seed.
+ */
+template <typename Scalar>
+std::tuple<MatrixX<Scalar>, MatrixX<Scalar>>
+perturb_observations(const VectorXd &obs_values, const ErrorCovariance &C,
+                     const ConstStridedRef<Scalar> &S,
+                     std::optional<MatrixX<Scalar>> noise,
+                     std::optional<std::uint64_t> seed,
+                     std::optional<VectorXd> scale, MatrixX<Scalar> *Y) {
+  const Index nobs = S.rows();
+  const Index ens_size = S.cols();
+  if (obs_values.size() != nobs || C.size() != nobs)
+    throw std::invalid_argument(
+        "obs_values and C must have one element per row of S");
+  const VectorX<Scalar> inv_scale =
+      (scale ? *scale : C.variances().cwiseSqrt())
+          .cwiseInverse()
+          .template cast<Scalar>();
+  if (inv_scale.size() != nobs)
+    throw std::invalid_argument("scale must have one element per row of S");
+  if (Y != nullptr && ens_size < 2)
+    throw std::invalid_argument("S must have at least two realizations");
+  const VectorX<Scalar> d = obs_values.template cast<Scalar>();
+
+  MatrixX<Scalar> E;
+  if (noise) {
+    if (noise->rows() != nobs || noise->cols() != ens_size)
+      throw std::invalid_argument("noise must have the same shape as S");
+    E = std::move(*noise);
+  } else {
+    E.resize(nobs, ens_size);
+    standard_normal(E, seed ? *seed : std::random_device{}());
+  }
+
+  C.factor_multiply(E);
+  const VectorX<Scalar> mean = E.rowwise().mean();
+
+  VectorX<Scalar> S_mean;
+  VectorX<Scalar> Y_scale;
+  if (Y != nullptr) {
+    S_mean = S.rowwise().mean();
+    Y_scale = inv_scale / static_cast<Scalar>(sqrt(ens_size - 1.0));
+    Y->resize(nobs, ens_size);
+  }
+
+  MatrixX<Scalar> D(nobs, ens_size);
+  IES_OMP(parallel for num_threads(Eigen::nbThreads()))
+  for (Index j = 0; j < ens_size; j++) {
+    E.col(j) = (E.col(j) - mean).cwiseProduct(inv_scale);
+    D.col(j) = (d - S.col(j)).cwiseProduct(inv_scale) + E.col(j);
+    if (Y != nullptr)
+      Y->col(j) = (S.col(j) - S_mean).cwiseProduct(Y_scale);
+  }
+
+  return {std::move(E), std::move(D)};
+}
+
+/**
+ * E and D, see perturb_observations.
+ */
+template <typename Scalar>
+std::tuple<MatrixX<Scalar>, MatrixX<Scalar>>
+make_E_D(const VectorXd &obs_values, const ErrorCovariance &C,
+         const ConstStridedRef<Scalar> &S,
+         std::optional<MatrixX<Scalar>> noise,
+         std::optional<std::uint64_t> seed, std::optional<VectorXd> scale) {
+  return perturb_observations<Scalar>(obs_values, C, S, std::move(noise),
+                                      seed, std::move(scale), nullptr);
+}
+
+/**
+ * Y, E and D for create_coefficient_matrix from the raw responses S, see
+ * perturb_observations.
+ */
+template <typename Scalar>
+std::tuple<MatrixX<Scalar>, MatrixX<Scalar>, MatrixX<Scalar>>
+make_Y_E_D(const VectorXd &obs_values, const ErrorCovariance &C,
+           const ConstStridedRef<Scalar> &S,
+           std::optional<MatrixX<Scalar>> noise,
+           std::optional<std::uint64_t> seed, std::optional<VectorXd> scale) {
+  MatrixX<Scalar> Y;
+  auto [E, D] = perturb_observations<Scalar>(
+      obs_values, C, S, std::move(noise), seed, std::move(scale), &Y);
+  return {std::move(Y), std::move(E), std::move(D)};
+}
+
+/**
+ * Computes A <- A * M in place, or A <- A + diag(scaling) * A * M when
+ * scaling is given, for A of size (num_params x N) and M of size (N x N).
+ *
+ * A is processed in blocks of block_rows rows, in parallel across blocks, so
+ * that besides A the memory used is M and two blocks per thread. A may have
+ * any strides, e.g. a row-major np.memmap.
+ */
+template <typename Scalar>
+void multiply_row_blocks(StridedRef<Scalar> A,
+                         const Eigen::Ref<const MatrixXd> &M,
+                         const VectorXd *scaling, Index block_rows) {
+  if (M.rows() != A.cols() || M.cols() != A.cols())
+    throw std::invalid_argument(
+        "Transition matrix must be square with one row per column of A");
+  if (scaling && scaling->size() != A.rows())
+    throw std::invalid_argument("scaling must have one element per row of A");
+  if (block_rows < 1)
+    throw std::invalid_argument("block_rows must be positive");
+
+  const MatrixX<Scalar> M_s = M.template cast<Scalar>();
+  auto update = [&](const auto &block, MatrixX<Scalar> &updated,
+                    Index first) {
+    const Index rows = block.rows();
+    updated.noalias() = block * M_s;
+    if (scaling)
+      A.middleRows(first, rows) +=
+          scaling->segment(first, rows).template cast<Scalar>().asDiagonal() *
+          updated;
+    else
+      A.middleRows(first, rows) = updated;
+  };
+
+  const Index num_blocks = (A.rows() + block_rows - 1) / block_rows;
+  if (num_blocks < 2) {
+    /* Leave the threads to the matrix product instead, which reads A
+     * directly as it is only written after */
+    MatrixX<Scalar> updated;
+    update(A, updated, 0);
+    return;
+  }
+
+  IES_OMP(parallel num_threads(Eigen::nbThreads()))
+  {
+    MatrixX<Scalar> block, updated;
+    IES_OMP(for schedule(static))
+    for (Index b = 0; b < num_blocks; b++) {
+      const Index first = b * block_rows;
+      block = A.middleRows(first, std::min(block_rows, A.rows() - first));
+      update(block, updated, first);
+    }
+  }
+}
+
+/**
+ * Computes A <- A * T in place, Line 9 of Algorithm 1 with T = I + W / sqrt(N
+ * - 1). See multiply_row_blocks.
+ */
+template <typename Scalar>
+void apply_transition_matrix(StridedRef<Scalar> A,
+                             const Eigen::Ref<const MatrixXd> &T,
+                             Index block_rows) {
+  ProfileStage call("apply_transition_matrix",
+                    2.0 * A.rows() * A.cols() * A.cols());
+  multiply_row_blocks<Scalar>(A, T, nullptr, block_rows);
+}
+
+/**
+ * Row scaling localization of the update, in place. Row i of A is updated
+ * with the transition matrix I + scaling(i) * W / sqrt(N - 1), i.e.
+ *
+ *   A_i <- A_i + scaling(i) * A_i * W / sqrt(N - 1).
+ *
+ * See multiply_row_blocks.
+ */
+template <typename Scalar>
+void apply_row_scaling(StridedRef<Scalar> A, const VectorXd &scaling,
+                       const Eigen::Ref<const MatrixXd> &W,
+                       Index block_rows) {
+  const MatrixXd W_scaled = W / sqrt(A.cols() - 1.0);
+  multiply_row_blocks<Scalar>(A, W_scaled, &scaling, block_rows);
+}
+
+/**
+ * State of the subspace iterative ensemble smoother across iterations.
+ *
+ * Owns the coefficient matrix W of the initial ensemble, the indices of the
+ * currently active realizations and the workspace, so that an iteration
+ * neither copies W in and out of Python nor reallocates the large buffers
+ * used by create_coefficient_matrix.
+ */
+class SIESState {
+public:
+  explicit SIESState(Index ensemble_size, SolverOptions options = {})
+      : options(options), W_(MatrixXd::Zero(ensemble_size, ensemble_size)) {
+    active_.resize(ensemble_size);
+    for (Index i = 0; i < ensemble_size; i++)
+      active_[i] = i;
+  }
+
+  /**
+   * Sets the parameter ensemble of the active realizations, whose row space
+   * the responses are projected onto by fit and factorize until it is
+   * cleared. See ResponseProjection. Returns whether the projection was
+   * recomputed.
+   */
+  template <typename Scalar>
+  bool set_param_ensemble(const ConstStridedRef<Scalar> &param_ensemble) {
+    return projection_.set(param_ensemble);
+  }
+
+  void clear_param_ensemble() { projection_.clear(); }
+
+  /**
+   * Performs one iteration, see create_coefficient_matrix.
+   *
+   * @param ensemble_mask Which realizations of the initial ensemble the
+   *        columns of Y, E and D belong to. Defaults to all.
+   */
+  template <typename Scalar>
+  void fit(const ConstStridedRef<Scalar> &Y, const ErrorCovariance *R,
+           const ConstStridedRef<Scalar> &E,
+           const ConstStridedRef<Scalar> &D,
+           const Inversion ies_inversion,
+           const std::variant<double, int> &truncation, double ies_steplength,
+           const std::optional<Eigen::Array<bool, Eigen::Dynamic, 1>>
+               &ensemble_mask) {
+    MatrixXd &W = activate(ensemble_mask, Y.cols());
+    W_next_ = W;
+    create_coefficient_matrix<Scalar>(
+        Y, R, E, D, ies_inversion, truncation, W_next_, ies_steplength,
+        options, std::get<Workspace<Scalar>>(ws_), projection(Y.cols()));
+    commit(W);
+  }
+
+  /**
+   * Performs one iteration with the exact inversion from the Gram products
+   * of the observations, see GramAccumulator.
+   */
+  void fit(const GramAccumulator &gram, double ies_steplength,
+           const std::optional<Eigen::Array<bool, Eigen::Dynamic, 1>>
+               &ensemble_mask) {
+    MatrixXd &W = activate(ensemble_mask, gram.ensemble_size());
+    W_next_ = W;
+    gram.update(W_next_, ies_steplength, options,
+                std::get<Workspace<double>>(ws_));
+    commit(W);
+  }
+
+  /**
+   * Performs one iteration with the exact inversion, as fit with a
+   * GramAccumulator of Y and D, and keeps the Gram products and the W the
+   * iteration started from. Observations appended before the next iteration
+   * are then added to this one by append_observations.
+   */
+  template <typename Scalar>
+  void fit_incremental(const ConstStridedRef<Scalar> &Y,
+                       const ConstStridedRef<Scalar> &D,
+                       double ies_steplength,
+                       const std::optional<Eigen::Array<bool, Eigen::Dynamic, 1>>
+                           &ensemble_mask) {
+    MatrixXd &W = activate(ensemble_mask, Y.cols());
+    gram_ = GramAccumulator(Y.cols());
+    gram_.add<Scalar>(Y, D);
+    W_start_ = W;
+    steplength_ = ies_steplength;
+    refit(W);
+  }
+
+  /**
+   * Redoes the last fit_incremental with the observations in the rows of Y
+   * and D added to those assimilated so far. Only the new rows are read, so
+   * the cost is O(nrobs_new * nrens^2 + nrens^3) rather than proportional to
+   * all the observations of the iteration. The errors of the new
+   * observations must be uncorrelated with those of the earlier ones.
+   */
+  template <typename Scalar>
+  void append_observations(const ConstStridedRef<Scalar> &Y,
+                           const ConstStridedRef<Scalar> &D) {
+    if (!incremental_)
+      throw std::invalid_argument(
+          "append_observations must follow fit_incremental");
+    MatrixXd &W = active_block(Y.cols());
+    gram_.add<Scalar>(Y, D);
+    refit(W);
+  }
+
+  /* The observations assimilated by fit_incremental and append_observations */
+  Index num_incremental_observations() const {
+    return incremental_ ? gram_.num_observations() : 0;
+  }
+
+  /**
+   * Factorizes the next iteration for the active realizations given by
+   * ensemble_mask, see CoefficientMatrixFactors.
+   */
+  template <typename Scalar>
+  CoefficientMatrixFactors
+  factorize(const ConstStridedRef<Scalar> &Y, const ErrorCovariance *R,
+            const ConstStridedRef<Scalar> &E, const ConstStridedRef<Scalar> &D,
+            const Inversion ies_inversion,
+            const std::optional<Eigen::Array<bool, Eigen::Dynamic, 1>>
+                &ensemble_mask) {
+    const MatrixXd &W = activate(ensemble_mask, Y.cols());
+    return CoefficientMatrixFactors(Y, R, E, D, ies_inversion, W, options,
+                                    projection(Y.cols()));
+  }
+
+  /**
+   * Performs the iteration factorized by factorize with the given
+   * truncation and step length.
+   */
+  void fit(const CoefficientMatrixFactors &factors,
+           const std::variant<double, int> &truncation,
+           double ies_steplength) {
+    MatrixXd &W = active_block(factors.ensemble_size());
+    if (W != factors.initial_coefficient_matrix())
+      throw std::invalid_argument(
+          "factors were computed for a different coefficient matrix");
+    W_next_ = factors.coefficient_matrix(truncation, ies_steplength);
+    commit(W);
+  }
+
+  /**
+   * I + W / sqrt(N - 1) restricted to the active realizations, Line 9 of
+   * Algorithm 1.
+   */
+  MatrixXd transition_matrix() const {
+    const Index ens_size = active_.size();
+    MatrixXd T;
+    if (compact_)
+      T = W_active_ / sqrt(ens_size - 1.0);
+    else
+      T = W_(active_, active_) / sqrt(ens_size - 1.0);
+    T.diagonal().array() += 1.0;
+    return T;
+  }
+
+  MatrixXd &coefficient_matrix() {
+    scatter();
+    return W_;
+  }
+
+  Eigen::Array<bool, Eigen::Dynamic, 1> ensemble_mask() const {
+    Eigen::Array<bool, Eigen::Dynamic, 1> mask =
+        Eigen::Array<bool, Eigen::Dynamic, 1>::Zero(W_.rows());
+    for (Index i : active_)
+      mask(i) = true;
+    return mask;
+  }
+
+  SolverOptions options;
+
+private:
+  /**
+   * Updates the active realizations from ensemble_mask, all realizations if
+   * it is not given, and returns the coefficient matrix restricted to them.
+   * The state is only changed once the mask is known to match num_active.
+   *
+   * While some realizations are inactive, W_active_ holds the active block
+   * of W across iterations and is only gathered when the mask changes, so
+   * iterating with the same mask copies no (N x N) blocks.
+   */
+  MatrixXd &activate(
+      const std::optional<Eigen::Array<bool, Eigen::Dynamic, 1>> &ensemble_mask,
+      Index num_active) {
+    std::vector<Index> active;
+    if (ensemble_mask) {
+      if (ensemble_mask->size() != W_.rows())
+        throw std::invalid_argument(
+            "ensemble_mask must have one element per realization");
+      active.reserve(ensemble_mask->count());
+      for (Index i = 0; i < ensemble_mask->size(); i++)
+        if ((*ensemble_mask)(i))
+          active.push_back(i);
+    } else {
+      active.resize(W_.rows());
+      for (Index i = 0; i < W_.rows(); i++)
+        active[i] = i;
+    }
+    if (static_cast<Index>(active.size()) != num_active)
+      throw std::invalid_argument("Number of active realizations must match "
+                                  "the number of columns of Y");
+
+    if (active != active_) {
+      scatter();
+      compact_ = false;
+      active_ = std::move(active);
+    }
+    return active_block(num_active);
+  }
+
+  /**
+   * The coefficient matrix restricted to the realizations active in the last
+   * fit, for the calls that continue it.
+   */
+  MatrixXd &active_block(Index num_active) {
+    if (static_cast<Index>(active_.size()) != num_active)
+      throw std::invalid_argument("Number of active realizations must match "
+                                  "the number of columns of Y");
+    if (all_active())
+      return W_;
+    if (!compact_) {
+      W_active_ = W_(active_, active_);
+      compact_ = true;
+    }
+    return W_active_;
+  }
+
+  /**
+   * Replaces W, as returned by activate, with W_next_.
+   */
+  void commit(MatrixXd &W) {
+    if (W_next_.hasNaN())
+      throw std::invalid_argument(
+          "Fit produces NaNs. Check your response matrix for outliers or use "
+          "an inversion type with truncation.");
+
+    /* The previous W is kept as the buffer of the next iteration */
+    W.swap(W_next_);
+    stale_ = compact_;
+    incremental_ = false;
+  }
+
+  /**
+   * Replaces W with the iteration from W_start_ with the Gram products in
+   * gram_, see fit_incremental.
+   */
+  void refit(MatrixXd &W) {
+    W_next_ = W_start_;
+    gram_.update(W_next_, steplength_, options,
+                 std::get<Workspace<double>>(ws_));
+    commit(W);
+    incremental_ = true;
+  }
+
+  /**
+   * Writes W_active_ back to W_ if W_ is behind it.
+   */
+  void scatter() {
+    if (stale_)
+      W_(active_, active_) = W_active_;
+    stale_ = false;
+  }
+
+  bool all_active() const {
+    return static_cast<Index>(active_.size()) == W_.rows();
+  }
+
+  const MatrixXd *projection(Index num_active) const {
+    const MatrixXd *projection = projection_.matrix();
+    if (projection != nullptr && projection->rows() != num_active)
+      throw std::invalid_argument("param_ensemble and response_ensemble must "
+                                  "have the same number of columns");
+    return projection;
+  }
+
+  MatrixXd W_;
+  MatrixXd W_active_;
+  MatrixXd W_next_;
+  /* Whether W_active_ holds the active block of W */
+  bool compact_ = false;
+  /* Whether W_ is behind W_active_ */
+  bool stale_ = false;
+  std::vector<Index> active_;
+  ResponseProjection projection_;
+  /* Kept by fit_incremental for append_observations */
+  GramAccumulator gram_{0};
+  MatrixXd W_start_;
+  double steplength_ = 0.0;
+  /* Whether W is the result of gram_ and W_start_ */
+  bool incremental_ = false;
+  /* Only the workspace of the precision in use allocates */
+  std::tuple<Workspace<float>, Workspace<double>> ws_;
+};
+
+/**
+ * Sets the number of threads used by the Eigen kernels. Has no effect unless
+ * the module is built with OpenMP.
+ */
+inline void set_num_threads(int num_threads) {
+  if (num_threads < 1)
+    throw std::invalid_argument("num_threads must be positive");
+#ifdef _OPENMP
+  omp_set_num_threads(num_threads);
+#endif
+  Eigen::setNbThreads(num_threads);
+}
+
+inline int get_num_threads() { return Eigen::nbThreads(); }
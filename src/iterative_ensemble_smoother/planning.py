@@ -0,0 +1,379 @@
+"""
+Predicted memory use and floating point operations of a fit and an update.
+
+:func:`estimate` gives the stages of :meth:`SIES.fit` or :meth:`SIES.fit_blocks`
+followed by :meth:`SIES.update` for the shapes of a problem, with the names
+:func:`~iterative_ensemble_smoother.profiling.profile` records them under. Each
+stage has an estimate of its flops, of the bytes of the temporaries it writes,
+as in the profile, and of all the bytes in memory while it runs. Nothing is
+allocated, so a job can be checked against the memory of a node before it is
+submitted. :func:`plan` chooses how to run it within a memory budget,
+streaming the observations only when the exact fit does not fit.
+
+>>> from iterative_ensemble_smoother.planning import estimate, plan
+>>> p = estimate(num_obs=100_000, ensemble_size=100, num_params=1_000_000)
+>>> round(p.peak_bytes / 2**20)
+1755
+>>> p = plan(100_000, 100, 1_000_000, memory_budget=2**30)
+>>> p.strategy, p.observation_block_size, p.update_block_size
+('exact', None, 4096)
+>>> p = plan(100_000, 100, 1_000_000, memory_budget=2**28)
+>>> p.strategy, p.observation_block_size, p.update_block_size
+('streaming', 50000, 4096)
+
+The estimates are computed from the shapes, not measured, and err on the
+large side. The responses given to fit, and the parameters unless they are
+updated in blocks, are assumed to be held by the caller throughout. The
+observation errors are assumed to be given as standard deviations. With a
+fractional truncation the number of significant singular values is not known
+in advance, so it is taken to be its upper bound, min(num_obs, ensemble_size).
+"""
+from __future__ import annotations
+
+import math
+from dataclasses import dataclass, field
+from typing import TYPE_CHECKING, Dict, Iterator, List, Optional, Union
+
+import numpy as np
+
+from . import _ies
+from ._ies import InversionType, SolverOptions, SVDEngine
+
+if TYPE_CHECKING:
+    import numpy.typing as npt
+
+    from ._iterative_ensemble_smoother import SIES
+
+# - exact: SIES.fit with the exact inversion.
+# - streaming: SIES.fit_blocks with blocks of observation_block_size
+#   observations, which accumulates the Gram products of the exact inversion.
+# - subspace: SIES.fit with a subspace inversion.
+# - randomized: as subspace, with the randomized SVD of S.
+STRATEGIES = ("exact", "streaming", "subspace", "randomized")
+
+
+def _thin_svd_flops(m: float, n: float) -> float:
+    """See thin_svd_flops in ies.hpp."""
+    k = min(m, n)
+    return 6.0 * max(m, n) * k * k + 11.0 * k * k * k
+
+
+@dataclass
+class Plan:
+    """The predicted cost of a fit and an update, see :func:`estimate`."""
+
+    strategy: str
+    inversion: InversionType
+    num_obs: int
+    ensemble_size: int
+    num_params: int
+    dtype: np.dtype  # type: ignore[type-arg]
+    observation_block_size: Optional[int] = None
+    """Observations per block of :meth:`SIES.fit_blocks`, for streaming."""
+    update_block_size: Optional[int] = None
+    """Rows per block of :meth:`SIES.update` with ``in_place=True`` or of
+    :meth:`SIES.update_blocks`. None if the parameters are updated in memory
+    with :meth:`SIES.update`."""
+    stages: Dict[str, Dict[str, float]] = field(default_factory=dict)
+    """The number of calls, total flops, peak bytes of temporaries and peak
+    resident bytes of each stage, in the order they run."""
+
+    @property
+    def peak_bytes(self) -> int:
+        """The bytes in memory at the most demanding stage."""
+        return int(max(stage["resident_bytes"] for stage in self.stages.values()))
+
+    @property
+    def flops(self) -> float:
+        """The flops of all stages."""
+        return sum(stage["flops"] for stage in self.stages.values())
+
+    def solver_options(self) -> SolverOptions:
+        """The options of the native kernels that the plan assumes."""
+        options = SolverOptions()
+        if self.strategy == "randomized":
+            options.svd_engine = SVDEngine.RANDOMIZED
+        return options
+
+    def configure(self, smoother: SIES) -> None:
+        """Make ``smoother`` use the SVD engine of the plan, keeping its other
+        options. The inversion, observation blocks and update blocks are
+        passed by the caller."""
+        smoother.options.svd_engine = self.solver_options().svd_engine
+
+
+def estimate(
+    num_obs: int,
+    ensemble_size: int,
+    num_params: int = 0,
+    *,
+    inversion: InversionType = InversionType.EXACT,
+    strategy: Optional[str] = None,
+    truncation: Union[float, int] = 0.98,
+    dtype: npt.DTypeLike = np.float64,
+    observation_block_size: Optional[int] = None,
+    update_block_size: Optional[int] = None,
+    oversampling: int = 10,
+    power_iterations: int = 2,
+    num_threads: Optional[int] = None,
+) -> Plan:
+    """The predicted cost of one fit followed by an update of the parameters.
+
+    :param num_obs: The number of observations.
+    :param ensemble_size: The number of realizations.
+    :param num_params: The number of parameters. The update is left out if 0.
+    :param inversion: See :meth:`SIES.fit`.
+    :param strategy: One of :data:`STRATEGIES`. Defaults to exact for the
+        exact inversion and to subspace otherwise.
+    :param truncation: See :meth:`SIES.fit`.
+    :param dtype: The dtype of the responses and the parameters.
+    :param observation_block_size: Observations per block, for streaming.
+        Defaults to all observations in one block.
+    :param update_block_size: Rows per block of the update, see
+        :attr:`Plan.update_block_size`.
+    :param oversampling: See ``SolverOptions``, for randomized.
+    :param power_iterations: See ``SolverOptions``, for randomized.
+    :param num_threads: The number of threads updating blocks of parameters
+        at once. Defaults to ``_ies.get_num_threads()``.
+    """
+    if strategy is None:
+        strategy = "exact" if inversion == InversionType.EXACT else "subspace"
+    if strategy not in STRATEGIES:
+        raise ValueError(f"strategy must be one of {STRATEGIES}, got {strategy!r}")
+    if (strategy in ("exact", "streaming")) != (inversion == InversionType.EXACT):
+        raise ValueError(
+            f"The {strategy} strategy can not be used with inversion {inversion}"
+        )
+    if min(num_obs, ensemble_size) < 1 or num_params < 0:
+        raise ValueError("num_obs and ensemble_size must be positive")
+    if observation_block_size is not None and observation_block_size < 1:
+        raise ValueError("observation_block_size must be positive")
+    if update_block_size is not None and update_block_size < 1:
+        raise ValueError("update_block_size must be positive")
+    if num_threads is None:
+        num_threads = _ies.get_num_threads()
+
+    dtype = np.dtype(np.float32 if np.dtype(dtype) == np.float32 else np.float64)
+    s = float(dtype.itemsize)
+    d = 8.0
+    n = float(num_obs)
+    N = float(ensemble_size)
+    p = float(num_params)
+    m = min(n, N)
+    if isinstance(truncation, (int, np.integer)) and not isinstance(
+        truncation, bool
+    ):
+        k = float(min(int(truncation), m))
+    else:
+        k = m
+
+    result = Plan(
+        strategy=strategy,
+        inversion=inversion,
+        num_obs=num_obs,
+        ensemble_size=ensemble_size,
+        num_params=num_params,
+        dtype=dtype,
+        observation_block_size=None,
+        update_block_size=update_block_size,
+    )
+
+    # Held throughout: the parameters, unless updated in blocks, and W,
+    # Omega, C and K of the native state
+    resident = 4 * N * N * d
+    if update_block_size is None:
+        resident += p * N * s
+
+    def add(
+        name: str,
+        flops: float,
+        temporaries: float,
+        extra: Optional[float] = None,
+        calls: int = 1,
+    ) -> None:
+        """Adds a stage. extra is the bytes in memory besides `resident`,
+        defaulting to the temporaries."""
+        result.stages[name] = {
+            "calls": calls,
+            "flops": flops,
+            "peak_bytes": temporaries,
+            "resident_bytes": resident + (temporaries if extra is None else extra),
+        }
+
+    if strategy == "streaming":
+        b = float(min(observation_block_size or num_obs, num_obs))
+        result.observation_block_size = int(b)
+        num_blocks = math.ceil(n / b)
+        # One block of responses, Y, E and D, and Y' * Y and Y' * D
+        resident += 4 * b * N * s + 2 * N * N * d
+        add("make_Y_E_D", 6 * n * N, 3 * b * N * s, 0, calls=num_blocks)
+        add(
+            "gram_add",
+            3 * n * N * N,
+            N * N * s if s < d else 0,
+            calls=num_blocks,
+        )
+        add("gram_update", 11 * N * N * N, 3 * N * N * d)
+        # Y, E and D of the last block are released before the update
+        resident -= 3 * b * N * s
+    else:
+        # The responses, Y, E and D, and S and H of the workspace
+        resident += 6 * n * N * s
+        add("make_Y_E_D", 6 * n * N, 3 * n * N * s, 0)
+        add("omega_lu", 2 / 3 * N * N * N, 2 * N * N * d)
+        add("sensitivity", 2 * n * N * N, n * N * s, N * N * s)
+        add("innovation", 2 * n * N * N, n * N * s, N * N * s)
+
+        if strategy == "exact":
+            add(
+                "exact_inversion",
+                3 * n * N * N + 7 / 3 * N * N * N,
+                3 * N * N * d,
+                3 * N * N * d + (N * N * s if s < d else 0),
+            )
+        else:
+            # U0 and X1 of the workspace
+            resident += 2 * n * k * s
+            if strategy == "subspace":
+                # The left singular vectors kept by the SVD, and its copy of S
+                resident += n * m * s
+                add("svd_S", _thin_svd_flops(n, N), 2 * n * m * s, n * m * s)
+            else:
+                sketch = min(k + oversampling, m)
+                q = power_iterations
+                add(
+                    "svd_S",
+                    2 * n * N * sketch * (2 + 2 * q)
+                    + 4 * n * sketch * sketch * (q + 1)
+                    + _thin_svd_flops(sketch, N)
+                    + 2 * n * sketch * k,
+                    n * sketch * s + n * k * s,
+                    # The sketch and its QR factorization
+                    2 * n * sketch * s,
+                )
+            if inversion == InversionType.SUBSPACE_RE:
+                add(
+                    "svd_X0",
+                    2 * k * n * N + _thin_svd_flops(k, N) + 2 * n * k * k,
+                    2 * k * N * d + n * k * s,
+                    2 * k * N * d,
+                )
+            else:
+                # Diagonal R, and U0 is projected in double
+                add(
+                    "svd_X0",
+                    4 * n * k * k + _thin_svd_flops(k, k),
+                    2 * k * k * d + n * k * s,
+                    2 * k * k * d + n * k * d,
+                )
+            add("genX3", 2 * n * k * N, k * N * s)
+            add("update", 2 * (n + N) * N * k, N * k * d, N * k * (d + s))
+        # Y, E and D are released before the update
+        resident -= 3 * n * N * s
+
+    if num_params > 0:
+        if update_block_size is None:
+            # The result of param_ensemble @ transition_matrix
+            temporaries = p * N * s
+        else:
+            # A block and its product per thread, and the block of
+            # update_blocks
+            rows = min(float(update_block_size), p)
+            temporaries = (2 * min(num_threads, math.ceil(p / rows)) + 1) * rows * N * s
+        add("apply_transition_matrix", 2 * p * N * N, temporaries)
+
+    return result
+
+
+def _block_sizes(size: int, largest: Optional[int] = None) -> Iterator[int]:
+    """Halving block sizes from min(size, largest) down to 1."""
+    block = min(size, largest or size)
+    while block >= 1:
+        yield block
+        block //= 2
+
+
+def plan(
+    num_obs: int,
+    ensemble_size: int,
+    num_params: int = 0,
+    *,
+    memory_budget: int,
+    inversion: Optional[InversionType] = None,
+    truncation: Union[float, int] = 0.98,
+    dtype: npt.DTypeLike = np.float64,
+    num_threads: Optional[int] = None,
+) -> Plan:
+    """The plan with the fewest flops whose peak bytes fit within
+    ``memory_budget``, see :func:`estimate`. The exact strategy is chosen
+    whenever it fits though, as streaming solves the normal equations with
+    Y' * Y, whose condition number is the square of that of Y, and is only
+    used when the exact fit does not fit.
+
+    The parameters are updated in memory if possible, and otherwise in the
+    largest blocks of at most 4096 rows that fit. With streaming the
+    observations are given in the largest blocks that fit, found by halving.
+    Randomized is only chosen for an int truncation, since with a fraction
+    the sketch grows until it holds the requested variance. Streaming
+    assumes that the errors of different blocks are uncorrelated, see
+    :meth:`SIES.fit_blocks`.
+
+    :param memory_budget: The bytes available to the job.
+    :param inversion: The inversion to use. Defaults to choosing between the
+        exact and the subspace inversions, which give different results.
+    :raises ValueError: If no plan fits.
+    """
+    inversions: List[InversionType] = (
+        [inversion]
+        if inversion is not None
+        else [InversionType.EXACT, InversionType.EXACT_R, InversionType.SUBSPACE_RE]
+    )
+    update_block_sizes: List[Optional[int]] = [None]
+    if num_params > 0:
+        update_block_sizes += list(_block_sizes(num_params, 4096))
+
+    candidates: List[Plan] = []
+    smallest: Optional[Plan] = None
+    for inv in inversions:
+        if inv == InversionType.EXACT:
+            strategies = ["exact", "streaming"]
+        else:
+            strategies = ["subspace"]
+            if isinstance(truncation, (int, np.integer)):
+                strategies.append("randomized")
+        for strategy in strategies:
+            observation_block_sizes: List[Optional[int]] = (
+                list(_block_sizes(num_obs)) if strategy == "streaming" else [None]
+            )
+            fits = None
+            for update_block_size in update_block_sizes:
+                for observation_block_size in observation_block_sizes:
+                    candidate = estimate(
+                        num_obs,
+                        ensemble_size,
+                        num_params,
+                        inversion=inv,
+                        strategy=strategy,
+                        truncation=truncation,
+                        dtype=dtype,
+                        observation_block_size=observation_block_size,
+                        update_block_size=update_block_size,
+                        num_threads=num_threads,
+                    )
+                    if smallest is None or candidate.peak_bytes < smallest.peak_bytes:
+                        smallest = candidate
+                    if candidate.peak_bytes <= memory_budget:
+                        fits = candidate
+                        break
+                if fits is not None:
+                    candidates.append(fits)
+                    break
+
+    if not candidates:
+        assert smallest is not None
+        raise ValueError(
+            f"No plan fits within {memory_budget} bytes, the smallest needs "
+            f"{smallest.peak_bytes} bytes with the {smallest.strategy} strategy"
+        )
+    exact = [candidate for candidate in candidates if candidate.strategy == "exact"]
+    return min(exact or candidates, key=lambda candidate: candidate.flops)
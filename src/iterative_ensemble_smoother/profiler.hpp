@@ -0,0 +1,156 @@
+/*
+ * Opt-in instrumentation of the stages of the kernels in ies.hpp.
+ *
+ * Each stage records its wall time together with an estimate of its floating
+ * point operations and of the bytes of the temporaries it writes, both
+ * computed from the matrix shapes. Stages nest inside the top level call
+ * that ran them, so the events can be aggregated per call, per run or shown
+ * as a timeline. When profiling is disabled a stage costs one atomic load.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+struct ProfileEvent {
+  std::string name;
+  std::uint64_t call;  /* Index of the top level call */
+  int depth;           /* 0 for the top level call */
+  int thread;          /* OpenMP thread number */
+  double start_us;     /* Since the profiler was created */
+  double duration_us;
+  double flops;        /* Estimated floating point operations */
+  std::size_t bytes;   /* Estimated bytes of temporaries */
+};
+
+class Profiler {
+public:
+  void enable(bool enabled) { enabled_.store(enabled); }
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  void record(ProfileEvent event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back(std::move(event));
+  }
+
+  std::vector<ProfileEvent> events() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return events_;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.clear();
+  }
+
+  double now_us() const {
+    return std::chrono::duration<double, std::micro>(Clock::now() - epoch_)
+        .count();
+  }
+
+  std::uint64_t next_call() { return calls_.fetch_add(1); }
+
+private:
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point epoch_ = Clock::now();
+  std::atomic<bool> enabled_{false};
+  std::atomic<std::uint64_t> calls_{0};
+  mutable std::mutex mutex_;
+  std::vector<ProfileEvent> events_;
+};
+
+inline Profiler &profiler() {
+  static Profiler instance;
+  return instance;
+}
+
+/**
+ * Records the lifetime of the object as a stage. A stage started outside of
+ * any other stage on its thread is a top level call.
+ */
+class ProfileStage {
+public:
+  ProfileStage(const char *name, double flops = 0.0, std::size_t bytes = 0)
+      : enabled_(profiler().enabled()) {
+    if (!enabled_)
+      return;
+    if (depth() == 0)
+      call() = profiler().next_call();
+    event_.name = name;
+    event_.call = call();
+    event_.depth = depth()++;
+#ifdef _OPENMP
+    event_.thread = omp_get_thread_num();
+#else
+    event_.thread = 0;
+#endif
+    event_.flops = flops;
+    event_.bytes = bytes;
+    event_.start_us = profiler().now_us();
+  }
+
+  ~ProfileStage() {
+    if (!enabled_)
+      return;
+    event_.duration_us = profiler().now_us() - event_.start_us;
+    depth()--;
+    profiler().record(std::move(event_));
+  }
+
+  ProfileStage(const ProfileStage &) = delete;
+  ProfileStage &operator=(const ProfileStage &) = delete;
+
+  /* The call of the innermost stage running on this thread */
+  static std::uint64_t current_call() { return call(); }
+
+private:
+  friend class ProfileThread;
+
+  static int &depth() {
+    thread_local int depth = 0;
+    return depth;
+  }
+  static std::uint64_t &call() {
+    thread_local std::uint64_t call = 0;
+    return call;
+  }
+
+  const bool enabled_;
+  ProfileEvent event_;
+};
+
+/**
+ * Makes the stages of an OpenMP worker thread part of the call running on the
+ * thread that started the parallel region, given by
+ * ProfileStage::current_call() outside the region.
+ */
+class ProfileThread {
+public:
+  explicit ProfileThread(std::uint64_t call)
+      : joined_(ProfileStage::depth() == 0) {
+    if (joined_) {
+      ProfileStage::call() = call;
+      ProfileStage::depth() = 1;
+    }
+  }
+
+  ~ProfileThread() {
+    if (joined_)
+      ProfileStage::depth() = 0;
+  }
+
+  ProfileThread(const ProfileThread &) = delete;
+  ProfileThread &operator=(const ProfileThread &) = delete;
+
+private:
+  const bool joined_;
+};
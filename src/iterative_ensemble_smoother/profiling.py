@@ -0,0 +1,123 @@
+"""
+Per-stage timing of the native kernels.
+
+Within :func:`profile` the native module records each stage of the kernels,
+e.g. the LU factorization of Omega, the SVD of S or the final product of the
+subspace inversions, with its wall time, an estimate of its floating point
+operations and of the bytes of the temporaries it writes. The estimates are
+computed from the matrix shapes, not measured.
+
+>>> import numpy as np
+>>> from iterative_ensemble_smoother import SIES
+>>> rng = np.random.default_rng(0)
+>>> smoother = SIES(10)
+>>> with profile() as p:
+...     smoother.fit(rng.normal(size=(5, 10)), np.ones(5), np.zeros(5))
+>>> sorted(p.stages())  # doctest: +NORMALIZE_WHITESPACE
+['create_coefficient_matrix', 'exact_inversion', 'innovation', 'omega_lu',
+ 'sensitivity']
+"""
+from __future__ import annotations
+
+import json
+from contextlib import contextmanager
+from typing import Any, Dict, Iterator, List, Optional
+
+from . import _ies
+
+
+class Profile:
+    """The stages recorded by :func:`profile`. While the profile is active
+    the stages recorded so far are returned."""
+
+    def __init__(self) -> None:
+        self._events: Optional[List[Dict[str, Any]]] = None
+
+    @property
+    def events(self) -> List[Dict[str, Any]]:
+        """One dict per stage, in the order the stages finished. Stages at
+        depth 0 are the top level calls into the native module, and ``call``
+        is the index of the top level call a stage belongs to."""
+        if self._events is not None:
+            return self._events
+        events: List[Dict[str, Any]] = _ies.profile_events()
+        return events
+
+    @property
+    def num_calls(self) -> int:
+        """The number of top level calls recorded."""
+        return len({event["call"] for event in self.events})
+
+    def stages(self, call: Optional[int] = None) -> Dict[str, Dict[str, float]]:
+        """The number of calls, total seconds, total flops and peak bytes of
+        each stage.
+
+        :param call: Only include the stages of this top level call, counted
+            from the first call in the profile. Negative values count from the
+            last call, so ``call=-1`` gives the stages of the last fit.
+            Defaults to aggregating all calls.
+        """
+        events = self.events
+        if call is not None:
+            calls = sorted({event["call"] for event in events})
+            events = [event for event in events if event["call"] == calls[call]]
+
+        stages: Dict[str, Dict[str, float]] = {}
+        for event in events:
+            stage = stages.setdefault(
+                event["name"],
+                {"calls": 0, "seconds": 0.0, "flops": 0.0, "peak_bytes": 0},
+            )
+            stage["calls"] += 1
+            stage["seconds"] += event["duration_us"] * 1e-6
+            stage["flops"] += event["flops"]
+            stage["peak_bytes"] = max(stage["peak_bytes"], event["bytes"])
+        return stages
+
+    def trace_events(self) -> Dict[str, Any]:
+        """The stages in the Chrome trace event format, which can be opened
+        in chrome://tracing or https://ui.perfetto.dev."""
+        return {
+            "traceEvents": [
+                {
+                    "name": event["name"],
+                    "cat": "ies",
+                    "ph": "X",
+                    "ts": event["start_us"],
+                    "dur": event["duration_us"],
+                    "pid": 0,
+                    "tid": event["thread"],
+                    "args": {
+                        "call": event["call"],
+                        "flops": event["flops"],
+                        "bytes": event["bytes"],
+                    },
+                }
+                for event in self.events
+            ],
+            "displayTimeUnit": "ms",
+        }
+
+    def write_trace(self, path: str) -> None:
+        """Write :meth:`trace_events` to a JSON file."""
+        with open(path, "w", encoding="utf-8") as trace_file:
+            json.dump(self.trace_events(), trace_file)
+
+
+@contextmanager
+def profile() -> Iterator[Profile]:
+    """Record the stages of the native kernels called within the context.
+
+    Profiling is global to the process, so calls from other threads are
+    recorded too. Nesting profiles is not supported.
+    """
+    enabled = _ies.profiling_enabled()
+    _ies.reset_profile()
+    _ies.set_profiling(True)
+    result = Profile()
+    try:
+        yield result
+    finally:
+        result._events = _ies.profile_events()
+        _ies.set_profiling(enabled)
+        _ies.reset_profile()
@@ -1,18 +1,18 @@
 from __future__ import annotations
-from typing import Tuple, Optional, TYPE_CHECKING
+from typing import Tuple, Optional, Union, TYPE_CHECKING
 
 import numpy as np
 
 if TYPE_CHECKING:
     import numpy.typing as npt
 
-from ._ies import InversionType
+from ._ies import InversionType, ErrorCovariance
 
 
 def _validate_inputs(
     response_ensemble: npt.NDArray[np.double],
     noise: Optional[npt.NDArray[np.double]],
-    observation_errors: npt.NDArray[np.double],
+    observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
     observation_values: npt.NDArray[np.double],
     param_ensemble: Optional[npt.NDArray[np.double]] = None,
 ) -> None:
@@ -39,7 +39,12 @@ def _validate_inputs(
             "noise and response_ensemble must have the same number of rows"
         )
 
-    if len(observation_errors.shape) == 2:
+    if isinstance(observation_errors, ErrorCovariance):
+        if observation_errors.size != len(observation_values):
+            raise ValueError(
+                "observation_errors covariance matrix must match size of observation_values"
+            )
+    elif len(observation_errors.shape) == 2:
         if observation_errors.shape[0] != observation_errors.shape[1]:
             raise ValueError(
                 "observation_errors as covariance matrix must be a square matrix"
@@ -73,16 +78,38 @@ def _validate_inputs(
         )
 
 
+def _observation_covariance(
+    observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
+) -> Union[npt.NDArray[np.double], ErrorCovariance]:
+    """The covariance of the observation errors, which are given either as
+    standard deviations or as a covariance matrix."""
+    if isinstance(observation_errors, ErrorCovariance) or (
+        len(observation_errors.shape) == 2
+    ):
+        return observation_errors
+    return ErrorCovariance.diagonal(observation_errors**2)
+
+
 def _create_errors(
-    observation_errors: npt.NDArray[np.double],
+    observation_errors: Union[npt.NDArray[np.double], ErrorCovariance],
     inversion: InversionType,
-) -> Tuple[npt.NDArray[np.double], npt.NDArray[np.double]]:
+) -> Tuple[
+    Optional[Union[npt.NDArray[np.double], ErrorCovariance]], npt.NDArray[np.double]
+]:
+    R: Optional[Union[npt.NDArray[np.double], ErrorCovariance]]
+    if isinstance(observation_errors, ErrorCovariance):
+        # Scaling keeps the form of the covariance, so it is never dense
+        # unless given as dense.
+        errors: npt.NDArray[np.double] = np.sqrt(observation_errors.variances())
+        return observation_errors.scaled(1 / errors), errors
     if len(observation_errors.shape) == 2:
         R = observation_errors
         observation_errors = np.sqrt(observation_errors.diagonal())
-        R = np.diag(1 / observation_errors) @ R @ np.diag(1 / observation_errors)
+        R = R / np.outer(observation_errors, observation_errors)
     elif len(observation_errors.shape) == 1 and inversion == InversionType.EXACT_R:
-        R = np.identity(len(observation_errors))
+        # Errors are scaled by their standard deviations, leaving R = I, which
+        # is never materialized.
+        R = ErrorCovariance.identity(len(observation_errors))
     else:
         R = None
     return R, observation_errors
@@ -1,7 +1,16 @@
 from iterative_ensemble_smoother import ES, SIES, InversionType
+from iterative_ensemble_smoother import _ies
+from iterative_ensemble_smoother._cpu_features import supported_simd_variants
+from iterative_ensemble_smoother.planning import estimate, plan
+from iterative_ensemble_smoother.profiling import profile
+import importlib.util
+import json
+import os
 import numpy as np
 import pytest
 import re
+import subprocess
+import sys
 
 
 def test_that_repr_can_be_created():
@@ -114,3 +123,152 @@ def test_that_nans_produced_due_to_outliers_in_responses_are_handled():
     )
     param_ensemble = smoother.update(param_ensemble)
     assert np.isnan(param_ensemble).sum() == 0
+
+
+def test_that_num_threads_can_be_set():
+    num_threads = _ies.get_num_threads()
+    try:
+        _ies.set_num_threads(2)
+        assert _ies.get_num_threads() == (2 if _ies.has_openmp else 1)
+    finally:
+        _ies.set_num_threads(num_threads)
+
+    with pytest.raises(ValueError, match="num_threads must be positive"):
+        _ies.set_num_threads(0)
+
+
+def test_that_blas_backend_is_reported():
+    assert _ies.blas_backend in ["eigen", "openblas", "lapacke", "mkl"]
+
+
+def test_that_best_supported_simd_variant_is_loaded():
+    supported = supported_simd_variants()
+    assert supported[-1] == "baseline"
+    assert _ies.simd_variant in supported
+    assert isinstance(_ies.simd_instruction_sets, str)
+    # Variants before the loaded one are not installed
+    for variant in supported[: supported.index(_ies.simd_variant)]:
+        name = f"iterative_ensemble_smoother._ies_{variant}"
+        assert importlib.util.find_spec(name) is None
+
+    # A variant is loaded once per process, so others are loaded in a new one
+    for requested, returncode in [("baseline", 0), ("unknown", 1)]:
+        result = subprocess.run(
+            [
+                sys.executable,
+                "-c",
+                "from iterative_ensemble_smoother import _ies; "
+                "print(_ies.simd_variant)",
+            ],
+            env={**os.environ, "IES_SIMD": requested},
+            capture_output=True,
+            text=True,
+        )
+        assert result.returncode == returncode
+        if returncode == 0:
+            assert result.stdout.strip() == requested
+        else:
+            assert "is not supported by this CPU" in result.stderr
+
+
+def test_that_stages_are_profiled(tmp_path):
+    ensemble_size = 10
+    num_obs = 20
+    Y = np.random.normal(size=(num_obs, ensemble_size))
+    obs_errors = np.ones(num_obs)
+    obs_values = np.zeros(num_obs)
+    smoother = SIES(ensemble_size)
+
+    with profile() as p:
+        smoother.fit(Y, obs_errors, obs_values)
+        assert "exact_inversion" in p.stages(call=-1)
+        smoother.fit(Y, obs_errors, obs_values, inversion=InversionType.SUBSPACE_RE)
+    assert not _ies.profiling_enabled()
+
+    assert p.num_calls == 2
+    stages = p.stages()
+    assert stages["omega_lu"]["calls"] == 2
+    assert stages["sensitivity"]["flops"] > 0
+    assert "exact_inversion" not in p.stages(call=-1)
+    assert {"svd_S", "svd_X0", "genX3", "update"} <= set(p.stages(call=-1))
+
+    path = tmp_path / "trace.json"
+    p.write_trace(str(path))
+    trace = json.loads(path.read_text())
+    assert len(trace["traceEvents"]) == len(p.events)
+    assert all(event["ph"] == "X" for event in trace["traceEvents"])
+
+
+@pytest.mark.parametrize(
+    "inversion", [InversionType.EXACT, InversionType.SUBSPACE_RE]
+)
+def test_that_estimated_stages_match_the_profile(inversion):
+    ensemble_size = 10
+    num_obs = 20
+    Y = np.random.normal(size=(num_obs, ensemble_size))
+    smoother = SIES(ensemble_size)
+
+    with profile() as p:
+        smoother.fit(
+            Y, np.ones(num_obs), np.zeros(num_obs), inversion=inversion, truncation=5
+        )
+    profiled = p.stages()
+    estimated = estimate(num_obs, ensemble_size, inversion=inversion, truncation=5)
+
+    native = set(estimated.stages) - {"make_Y_E_D"}
+    assert native <= set(profiled)
+    for name in native:
+        assert estimated.stages[name]["flops"] == pytest.approx(
+            profiled[name]["flops"]
+        )
+        assert estimated.stages[name]["resident_bytes"] >= profiled[name]["peak_bytes"]
+
+
+def test_that_plan_fits_within_the_memory_budget():
+    shape = (100_000, 100, 1_000_000)
+    unlimited = plan(*shape, memory_budget=2**40, inversion=InversionType.EXACT)
+    assert unlimited.strategy == "exact"
+    assert unlimited.update_block_size is None
+    assert unlimited.flops <= estimate(*shape).flops
+
+    budget = unlimited.peak_bytes // 4
+    limited = plan(*shape, memory_budget=budget, inversion=InversionType.EXACT)
+    assert limited.peak_bytes <= budget
+    assert limited.update_block_size is not None
+
+    subspace = plan(
+        *shape,
+        memory_budget=2**30,
+        inversion=InversionType.SUBSPACE_RE,
+        truncation=20,
+    )
+    assert subspace.strategy in ["subspace", "randomized"]
+    assert subspace.peak_bytes <= 2**30
+
+    # Streaming only when the exact fit does not fit
+    streaming = plan(*shape, memory_budget=2**28, inversion=InversionType.EXACT)
+    assert streaming.strategy == "streaming"
+    assert streaming.peak_bytes <= 2**28
+
+    with pytest.raises(ValueError, match="No plan fits"):
+        plan(*shape, memory_budget=2**10)
+
+
+def test_that_plan_only_configures_the_svd_engine():
+    options = _ies.SolverOptions()
+    options.factorization = _ies.FactorizationType.SVD
+    smoother = SIES(10, options=options)
+
+    estimate(
+        1000,
+        10,
+        inversion=InversionType.SUBSPACE_RE,
+        strategy="randomized",
+        truncation=5,
+    ).configure(smoother)
+    assert smoother.options.svd_engine == _ies.SVDEngine.RANDOMIZED
+    assert smoother.options.factorization == _ies.FactorizationType.SVD
+
+    estimate(1000, 10).configure(smoother)
+    assert smoother.options.svd_engine == _ies.SVDEngine.EXACT
+    assert smoother.options.factorization == _ies.FactorizationType.SVD
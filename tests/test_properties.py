@@ -1,10 +1,27 @@
+import queue
+from concurrent.futures import ThreadPoolExecutor
+
 import numpy as np
 import pytest
 import pandas as pd
 from p_tqdm import p_map
 
-from iterative_ensemble_smoother._ies import make_D
+from iterative_ensemble_smoother._ies import (
+    ErrorCovariance,
+    FactorizationType,
+    SIESState,
+    SVDEngine,
+    create_coefficient_matrices,
+    create_coefficient_matrix,
+    make_D,
+    make_E_D,
+    make_Y_E_D,
+)
 import iterative_ensemble_smoother as ies
+from iterative_ensemble_smoother import distributed, gpu
+from iterative_ensemble_smoother.experimental import (
+    ensemble_smoother_update_step_row_scaling,
+)
 
 rng = np.random.default_rng()
 
@@ -397,6 +414,233 @@ def test_make_D():
     ]
 
 
+@pytest.mark.parametrize("order", ["C", "F"])
+def test_that_outputs_are_written_to_preallocated_arrays(order):
+    ensemble_size = 10
+    num_obs = 20
+    S = np.asarray(rng.normal(size=(num_obs, ensemble_size)), order=order)
+    E = np.asarray(rng.normal(size=(num_obs, ensemble_size)), order=order)
+    observation_values = rng.normal(size=num_obs)
+
+    out = np.zeros((num_obs, ensemble_size), order=order)
+    assert make_D(observation_values, E, S, out=out) is out
+    assert np.allclose(out, make_D(observation_values, E, S))
+
+    Y = (S - S.mean(axis=1, keepdims=True)) / np.sqrt(ensemble_size - 1)
+    args = (Y, None, E, out, ies.InversionType.EXACT, 1.0)
+    W = np.zeros((ensemble_size, ensemble_size), order=order)
+    expected = create_coefficient_matrix(*args, W, 0.5)
+    assert create_coefficient_matrix(*args, W, 0.5, out=W) is W
+    assert np.allclose(W, expected)
+
+    with pytest.raises(ValueError):
+        make_D(observation_values, E, S, out=out.astype(np.float32))
+    with pytest.raises(ValueError):
+        make_D(observation_values, E, S, out=out[:-1])
+
+
+@pytest.mark.parametrize("correlated", [False, True])
+def test_that_make_E_D_matches_numpy(correlated):
+    num_obs = 15
+    ensemble_size = 8
+    observation_values = rng.normal(size=num_obs)
+    S = rng.normal(size=(num_obs, ensemble_size))
+    noise = rng.normal(size=(num_obs, ensemble_size))
+    if correlated:
+        A = rng.normal(size=(num_obs, num_obs))
+        C = A @ A.T + np.identity(num_obs)
+        C_arg = C
+    else:
+        C = np.diag(rng.uniform(0.5, 2.0, size=num_obs))
+        C_arg = ErrorCovariance.diagonal(C.diagonal())
+    sd = np.sqrt(C.diagonal())
+
+    E = np.linalg.cholesky(C) @ noise
+    E = E - E.mean(axis=1, keepdims=True)
+    D = make_D(observation_values, E, S)
+
+    E_native, D_native = make_E_D(observation_values, C_arg, S, noise=noise)
+    assert np.allclose(E_native, (E.T / sd).T)
+    assert np.allclose(D_native, (D.T / sd).T)
+
+    Y = (S - S.mean(axis=1, keepdims=True)) / np.sqrt(ensemble_size - 1)
+    for dtype in [np.float64, np.float32]:
+        Y_native, E_native, D_native = make_Y_E_D(
+            observation_values, C_arg, S.astype(dtype), noise=noise.astype(dtype)
+        )
+        assert Y_native.dtype == dtype
+        assert np.allclose(Y_native, (Y.T / sd).T, atol=1e-5)
+        assert np.allclose(E_native, (E.T / sd).T, atol=1e-5)
+        assert np.allclose(D_native, (D.T / sd).T, atol=1e-5)
+
+
+def test_that_make_E_D_seeding_is_reproducible():
+    num_obs = 30
+    ensemble_size = 20
+    C = ErrorCovariance.low_rank(np.ones(num_obs), rng.normal(size=(num_obs, 3)))
+    S = rng.normal(size=(num_obs, ensemble_size))
+    observation_values = np.zeros(num_obs)
+
+    E_1, D_1 = make_E_D(observation_values, C, S, seed=123)
+    E_2, D_2 = make_E_D(observation_values, C, S, seed=123)
+    E_3, _ = make_E_D(observation_values, C, S, seed=124)
+    assert (E_1 == E_2).all() and (D_1 == D_2).all()
+    assert not np.allclose(E_1, E_3)
+    assert np.allclose(E_1.mean(axis=1), 0.0)
+
+
+@pytest.mark.parametrize(
+    "make_covariance",
+    [
+        pytest.param(lambda n: ErrorCovariance.identity(n), id="identity"),
+        pytest.param(
+            lambda n: ErrorCovariance.diagonal(rng.uniform(0.5, 2.0, size=n)),
+            id="diagonal",
+        ),
+        pytest.param(
+            lambda n: ErrorCovariance.block_diagonal(
+                [np.identity(n // 2) + 0.5, 2 * np.identity(n - n // 2)]
+            ),
+            id="block_diagonal",
+        ),
+        pytest.param(
+            lambda n: ErrorCovariance.low_rank(np.ones(n), rng.normal(size=(n, 2))),
+            id="low_rank",
+        ),
+    ],
+)
+def test_that_structured_error_covariance_matches_dense(make_covariance):
+    num_obs = 20
+    ensemble_size = 10
+    R = make_covariance(num_obs)
+    Y = rng.normal(size=(num_obs, ensemble_size))
+    E = rng.normal(size=(num_obs, ensemble_size))
+    D = rng.normal(size=(num_obs, ensemble_size))
+    W = np.zeros((ensemble_size, ensemble_size))
+
+    W_structured = create_coefficient_matrix(
+        Y, R, E, D, ies.InversionType.EXACT_R, 1.0, W.copy(), 1.0
+    )
+    W_dense = create_coefficient_matrix(
+        Y, R.to_dense(), E, D, ies.InversionType.EXACT_R, 1.0, W.copy(), 1.0
+    )
+    assert np.allclose(W_structured, W_dense)
+
+    scale = rng.uniform(0.5, 2.0, size=num_obs)
+    assert np.allclose(
+        R.scaled(scale).to_dense(), np.diag(scale) @ R.to_dense() @ np.diag(scale)
+    )
+
+
+@pytest.mark.parametrize(
+    "inversion", [ies.InversionType.EXACT, ies.InversionType.EXACT_R]
+)
+def test_that_sies_with_low_rank_errors_matches_dense(inversion):
+    num_obs = 40
+    ensemble_size = 15
+    R = ErrorCovariance.low_rank(
+        rng.uniform(0.5, 1.0, size=num_obs), rng.normal(size=(num_obs, 3))
+    )
+    responses = rng.normal(size=(num_obs, ensemble_size))
+    observation_values = rng.normal(size=num_obs)
+    # Without noise E = 0, so the factor of R that E is sampled with, which
+    # differs between the forms, does not matter
+    noise = np.zeros((num_obs, ensemble_size))
+
+    coefficient_matrices = []
+    for errors in [R, R.to_dense()]:
+        smoother = ies.SIES(ensemble_size)
+        smoother.fit(
+            responses, errors, observation_values, noise=noise, inversion=inversion
+        )
+        coefficient_matrices.append(smoother.coefficient_matrix)
+    assert np.allclose(*coefficient_matrices)
+
+
+def test_that_exact_inversion_factorizations_agree():
+    num_obs = 50
+    ensemble_size = 20
+    Y = rng.normal(size=(num_obs, ensemble_size))
+    E = rng.normal(size=(num_obs, ensemble_size))
+    D = rng.normal(size=(num_obs, ensemble_size))
+    W = rng.normal(size=(ensemble_size, ensemble_size)) * 0.1
+
+    W_cholesky, W_svd = (
+        create_coefficient_matrix(
+            Y,
+            None,
+            E,
+            D,
+            ies.InversionType.EXACT,
+            1.0,
+            W.copy(),
+            0.5,
+            factorization=factorization,
+        )
+        for factorization in [FactorizationType.CHOLESKY, FactorizationType.SVD]
+    )
+    assert np.allclose(W_cholesky, W_svd)
+
+
+def test_that_full_pivoting_fallback_for_omega_agrees():
+    num_obs = 50
+    ensemble_size = 20
+    Y = rng.normal(size=(num_obs, ensemble_size))
+    E = rng.normal(size=(num_obs, ensemble_size))
+    D = rng.normal(size=(num_obs, ensemble_size))
+    W = rng.normal(size=(ensemble_size, ensemble_size))
+
+    # rcond is at most 1, so omega_rcond=1.0 always uses full pivoting
+    W_partial, W_full = (
+        create_coefficient_matrix(
+            Y,
+            None,
+            E,
+            D,
+            ies.InversionType.EXACT,
+            1.0,
+            W.copy(),
+            0.5,
+            omega_rcond=omega_rcond,
+        )
+        for omega_rcond in [0.0, 1.0]
+    )
+    assert np.allclose(W_partial, W_full)
+
+
+@pytest.mark.parametrize(
+    "inversion", [ies.InversionType.EXACT_R, ies.InversionType.SUBSPACE_RE]
+)
+@pytest.mark.parametrize("truncation", [5, 0.99])
+def test_that_randomized_svd_matches_exact_svd_for_low_rank_responses(
+    inversion, truncation
+):
+    num_obs = 200
+    ensemble_size = 30
+    rank = 5
+    Y = rng.normal(size=(num_obs, rank)) @ rng.normal(size=(rank, ensemble_size))
+    E = rng.normal(size=(num_obs, ensemble_size))
+    D = rng.normal(size=(num_obs, ensemble_size))
+    R = ErrorCovariance.identity(num_obs)
+    W = np.zeros((ensemble_size, ensemble_size))
+
+    W_exact, W_randomized = (
+        create_coefficient_matrix(
+            Y,
+            R,
+            E,
+            D,
+            inversion,
+            truncation,
+            W.copy(),
+            1.0,
+            svd_engine=svd_engine,
+        )
+        for svd_engine in [SVDEngine.EXACT, SVDEngine.RANDOMIZED]
+    )
+    assert np.allclose(W_exact, W_randomized)
+
+
 @pytest.mark.parametrize(
     "ensemble_size,num_params,linear",
     [
@@ -513,3 +757,800 @@ def test_that_ies_runs_with_failed_realizations():
     param_ensemble = smoother.update(param_ensemble)
 
     assert param_ensemble.shape == (num_params, ens_mask.sum())
+
+
+def test_that_coefficient_matrix_is_not_changed_by_later_fits():
+    ensemble_size = 10
+    num_obs = 8
+    obs_errors = np.ones(num_obs)
+    obs_values = rng.normal(size=num_obs)
+    mask = np.ones(ensemble_size, dtype=bool)
+    mask[[1, 6]] = False
+    smoother = ies.SIES(ensemble_size)
+
+    smoother.fit(rng.normal(size=(num_obs, ensemble_size)), obs_errors, obs_values)
+    W = smoother.coefficient_matrix
+    W_copy = W.copy()
+    smoother.fit(rng.normal(size=(num_obs, ensemble_size)), obs_errors, obs_values)
+    assert np.array_equal(W, W_copy)
+
+    W = smoother.coefficient_matrix
+    W_copy = W.copy()
+    for _ in range(2):
+        smoother.fit(
+            rng.normal(size=(num_obs, mask.sum())),
+            obs_errors,
+            obs_values,
+            ensemble_mask=mask,
+        )
+        assert np.array_equal(W, W_copy)
+
+
+def test_that_unmasked_fit_after_masked_fit_activates_all_realizations():
+    ensemble_size = 10
+    num_obs = 8
+    obs_errors = np.ones(num_obs)
+    obs_values = rng.normal(size=num_obs)
+    mask = np.ones(ensemble_size, dtype=bool)
+    mask[[1, 6]] = False
+    smoother = ies.SIES(ensemble_size)
+
+    smoother.fit(
+        rng.normal(size=(num_obs, mask.sum())),
+        obs_errors,
+        obs_values,
+        ensemble_mask=mask,
+    )
+    smoother.fit(rng.normal(size=(num_obs, ensemble_size)), obs_errors, obs_values)
+    assert smoother.ensemble_mask.all()
+
+    # A fit that is rejected leaves the mask unchanged
+    with pytest.raises(ValueError, match="Number of active realizations"):
+        smoother.fit(
+            rng.normal(size=(num_obs, ensemble_size)),
+            obs_errors,
+            obs_values,
+            ensemble_mask=mask,
+        )
+    assert smoother.ensemble_mask.all()
+
+
+def test_that_sies_state_matches_coefficient_matrix_recursion():
+    ensemble_size = 20
+    num_obs = 8
+    state = SIESState(ensemble_size)
+    W_full = np.zeros((ensemble_size, ensemble_size))
+    masks = [np.ones(ensemble_size, dtype=bool), rng.random(ensemble_size) < 0.7]
+    masks.append(masks[-1] & (rng.random(ensemble_size) < 0.8))
+    for mask in masks:
+        ens_size = mask.sum()
+        Y = rng.normal(size=(num_obs, ens_size))
+        Y = (Y - Y.mean(axis=1, keepdims=True)) / np.sqrt(ens_size - 1)
+        E = rng.normal(size=(num_obs, ens_size))
+        D = rng.normal(size=(num_obs, ens_size))
+        W = create_coefficient_matrix(
+            Y,
+            None,
+            E,
+            D,
+            ies.InversionType.EXACT,
+            0.98,
+            W_full[mask][:, mask],
+            0.5,
+        )
+        W_full[np.outer(mask, mask)] = W.ravel()
+        state.fit(Y, None, E, D, ies.InversionType.EXACT, 0.98, 0.5, mask)
+        assert np.allclose(state.coefficient_matrix, W_full)
+        assert (state.ensemble_mask == mask).all()
+        assert np.allclose(
+            state.transition_matrix(),
+            np.identity(ens_size) + W / np.sqrt(ens_size - 1),
+        )
+
+
+def test_that_in_place_and_blockwise_updates_match_update(tmp_path):
+    ensemble_size = 15
+    num_params = 1000
+    num_obs = 10
+    smoother = ies.SIES(ensemble_size)
+    smoother.fit(
+        rng.normal(size=(num_obs, ensemble_size)),
+        rng.uniform(0.5, 1.0, size=num_obs),
+        rng.normal(size=num_obs),
+    )
+    X = rng.normal(size=(num_params, ensemble_size))
+    expected = smoother.update(X)
+
+    X_memmap = np.lib.format.open_memmap(
+        tmp_path / "X.npy", mode="w+", shape=X.shape, dtype=np.float64
+    )
+    X_memmap[:] = X
+    smoother.update(X_memmap, in_place=True, block_size=64)
+    assert np.allclose(X_memmap, expected)
+
+    X_blocks = X.copy()
+    smoother.update_blocks(
+        X_blocks[start : start + 300] for start in range(0, num_params, 300)
+    )
+    assert np.allclose(X_blocks, expected)
+
+
+def test_that_async_fit_and_pipelined_updates_match_synchronous():
+    ensemble_size = 15
+    num_params = 1000
+    num_obs = 10
+    responses = rng.normal(size=(num_obs, ensemble_size))
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    observation_values = rng.normal(size=num_obs)
+    noise = rng.normal(size=(num_obs, ensemble_size))
+    X = rng.normal(size=(num_params, ensemble_size))
+
+    smoother = ies.SIES(ensemble_size)
+    smoother.fit(responses, observation_errors, observation_values, noise=noise)
+    expected = smoother.update(X)
+
+    smoother = ies.SIES(ensemble_size)
+    fitted = smoother.fit_async(
+        responses, observation_errors, observation_values, noise=noise
+    )
+    # Submitted after the fit, so it waits for it
+    updated = smoother.update_async(X)
+    assert fitted.result() is None
+    assert np.allclose(updated.result(), expected)
+
+    starts = range(0, num_params, 300)
+    X_blocks = X.copy()
+    written = []
+
+    def write(index, block):
+        written.append(index)
+        assert np.allclose(block, expected[starts[index] : starts[index] + 300])
+
+    smoother.update_blocks_async(
+        (X_blocks[start : start + 300] for start in starts), write, max_pending=1
+    ).result()
+    assert written == list(range(len(starts)))
+    assert np.allclose(X_blocks, expected)
+
+    def failing_write(index, block):
+        raise OSError("disk full")
+
+    with pytest.raises(OSError, match="disk full"):
+        smoother.update_blocks_async([X.copy()], failing_write).result()
+
+
+@pytest.mark.parametrize("dtype", [np.float64, np.float32])
+def test_that_row_scaling_vector_interpolates_between_prior_and_es_update(dtype):
+    ensemble_size = 12
+    num_params = 40
+    num_obs = 6
+    Y = rng.normal(size=(num_obs, ensemble_size))
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    observation_values = rng.normal(size=num_obs)
+    noise = rng.normal(size=(num_obs, ensemble_size))
+    A = rng.normal(size=(num_params, ensemble_size))
+
+    smoother = ies.ES()
+    smoother.fit(Y, observation_errors, observation_values, noise=noise)
+    A_es = smoother.update(A)
+
+    scaling = rng.uniform(size=num_params)
+    scaling[:5] = 0.0
+    scaling[5:10] = 1.0
+    A_scaled = A.astype(dtype)
+    ensemble_smoother_update_step_row_scaling(
+        Y,
+        [(A_scaled, scaling)],
+        observation_errors,
+        observation_values,
+        noise=noise,
+    )
+    assert A_scaled.dtype == dtype
+    atol = 1e-5 if dtype == np.float32 else 1e-8
+    assert np.allclose(A_scaled, A + scaling[:, np.newaxis] * (A_es - A), atol=atol)
+    assert np.allclose(A_scaled[:5], A[:5], atol=atol)
+    assert np.allclose(A_scaled[5:10], A_es[5:10], atol=atol)
+
+
+@pytest.mark.parametrize(
+    "inversion",
+    [
+        ies.InversionType.EXACT,
+        ies.InversionType.EXACT_R,
+        ies.InversionType.SUBSPACE_RE,
+    ],
+)
+def test_that_batched_coefficient_matrices_match_subset_fits(inversion):
+    num_obs = 30
+    ensemble_size = 10
+    Y = rng.normal(size=(num_obs, ensemble_size))
+    E = rng.normal(size=(num_obs, ensemble_size))
+    D = rng.normal(size=(num_obs, ensemble_size))
+    W = 0.1 * rng.normal(size=(ensemble_size, ensemble_size))
+    A = rng.normal(size=(num_obs, num_obs))
+    R = A @ A.T + np.identity(num_obs)
+    subsets = [
+        np.arange(4, 20),
+        rng.choice(num_obs, size=7, replace=False),
+        np.arange(num_obs),
+    ]
+
+    Ws = create_coefficient_matrices(Y, R, E, D, inversion, 0.95, W, 0.6, subsets)
+    assert len(Ws) == len(subsets)
+    for rows, W_batched in zip(subsets, Ws):
+        W_subset = create_coefficient_matrix(
+            Y[rows],
+            R[np.ix_(rows, rows)],
+            E[rows],
+            D[rows],
+            inversion,
+            0.95,
+            W.copy(),
+            0.6,
+        )
+        assert np.allclose(W_batched, W_subset)
+
+    with pytest.raises(ValueError, match="Covariance size"):
+        create_coefficient_matrices(
+            Y, R[:-1, :-1], E, D, inversion, 0.95, W, 0.6, subsets
+        )
+
+
+@pytest.mark.parametrize(
+    "inversion",
+    [ies.InversionType.EXACT, ies.InversionType.EXACT_R, ies.InversionType.SUBSPACE_RE],
+)
+def test_that_float32_fit_and_update_match_float64(inversion):
+    ensemble_size = 30
+    num_obs = 50
+    num_params = 200
+    response_ensemble = rng.normal(size=(num_obs, ensemble_size))
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    observation_values = rng.normal(size=num_obs)
+    noise = rng.normal(size=(num_obs, ensemble_size))
+    X = rng.normal(size=(num_params, ensemble_size))
+
+    updates = []
+    for dtype in [np.float64, np.float32]:
+        smoother = ies.SIES(ensemble_size)
+        smoother.fit(
+            response_ensemble.astype(dtype),
+            observation_errors,
+            observation_values,
+            noise=noise.astype(dtype),
+            inversion=inversion,
+            truncation=1.0,
+        )
+        X_dtype = X.astype(dtype)
+        updated = smoother.update(X_dtype)
+        assert updated.dtype == dtype
+        smoother.update(X_dtype, in_place=True)
+        assert np.allclose(X_dtype, updated, rtol=1e-5, atol=1e-5)
+        updates.append(updated)
+
+    assert np.allclose(updates[0], updates[1], rtol=1e-4, atol=1e-4)
+
+
+def test_that_float32_with_dense_covariance_stays_float32():
+    ensemble_size = 10
+    num_obs = 20
+    A = rng.normal(size=(num_obs, num_obs))
+    R = A @ A.T / num_obs + np.identity(num_obs)
+    Y = rng.normal(size=(num_obs, ensemble_size))
+    E = rng.normal(size=(num_obs, ensemble_size))
+    D = rng.normal(size=(num_obs, ensemble_size))
+    W = np.zeros((ensemble_size, ensemble_size))
+
+    # The dense R is converted to an ErrorCovariance, which must not make the
+    # double overload match first
+    results = [
+        create_coefficient_matrix(
+            *(M.astype(dtype) for M in (Y, R, E, D)),
+            ies.InversionType.EXACT_R,
+            1.0,
+            W.astype(dtype),
+            1.0,
+        )
+        for dtype in [np.float64, np.float32]
+    ]
+    assert results[1].dtype == np.float32
+    assert np.allclose(results[0], results[1], rtol=1e-4, atol=1e-4)
+
+    Y_native, E_native, D_native = make_Y_E_D(
+        rng.normal(size=num_obs),
+        R,
+        Y.astype(np.float32),
+        noise=E.astype(np.float32),
+    )
+    assert Y_native.dtype == E_native.dtype == D_native.dtype == np.float32
+
+
+def test_that_fit_blocks_matches_fit_with_all_observations():
+    ensemble_size = 20
+    num_obs = 45
+    responses = rng.normal(size=(num_obs, ensemble_size))
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    observation_values = rng.normal(size=num_obs)
+    noise = rng.normal(size=(num_obs, ensemble_size))
+    mask = rng.random(ensemble_size) < 0.8
+
+    smoother = ies.SIES(ensemble_size)
+    smoother_blocks = ies.SIES(ensemble_size)
+    for ensemble_mask in [None, mask]:
+        columns = slice(None) if ensemble_mask is None else ensemble_mask
+        smoother.fit(
+            responses[:, columns],
+            observation_errors,
+            observation_values,
+            noise=noise[:, columns],
+            ensemble_mask=ensemble_mask,
+        )
+        smoother_blocks.fit_blocks(
+            (
+                (
+                    responses[rows, columns],
+                    observation_errors[rows],
+                    observation_values[rows],
+                    noise[rows, columns],
+                )
+                for rows in np.array_split(np.arange(num_obs), 4)
+            ),
+            ensemble_mask=ensemble_mask,
+        )
+        assert np.allclose(
+            smoother_blocks.coefficient_matrix, smoother.coefficient_matrix
+        )
+
+
+def test_that_appended_observations_match_fit_with_all_observations():
+    ensemble_size = 20
+    num_obs = 45
+    responses = rng.normal(size=(num_obs, ensemble_size))
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    observation_values = rng.normal(size=num_obs)
+    noise = rng.normal(size=(num_obs, ensemble_size))
+    mask = rng.random(ensemble_size) < 0.8
+
+    smoother = ies.SIES(ensemble_size)
+    smoother_incremental = ies.SIES(ensemble_size)
+    for ensemble_mask in [None, mask]:
+        columns = slice(None) if ensemble_mask is None else ensemble_mask
+        smoother.fit(
+            responses[:, columns],
+            observation_errors,
+            observation_values,
+            noise=noise[:, columns],
+            ensemble_mask=ensemble_mask,
+        )
+        first, *appended = np.array_split(np.arange(num_obs), 3)
+        smoother_incremental.fit_incremental(
+            responses[first][:, columns],
+            observation_errors[first],
+            observation_values[first],
+            noise=noise[first][:, columns],
+            ensemble_mask=ensemble_mask,
+        )
+        for rows in appended:
+            smoother_incremental.append_observations(
+                responses[rows][:, columns],
+                observation_errors[rows],
+                observation_values[rows],
+                noise=noise[rows][:, columns],
+            )
+        assert smoother_incremental._state.num_incremental_observations == num_obs
+        assert np.allclose(
+            smoother_incremental.coefficient_matrix, smoother.coefficient_matrix
+        )
+
+    smoother_incremental.fit(responses, observation_errors, observation_values)
+    with pytest.raises(ValueError, match="must follow fit_incremental"):
+        smoother_incremental.append_observations(
+            responses, observation_errors, observation_values
+        )
+
+
+@pytest.mark.parametrize(
+    "inversion",
+    [ies.InversionType.EXACT, ies.InversionType.EXACT_R, ies.InversionType.SUBSPACE_RE],
+)
+def test_that_factorized_fits_match_fit(inversion):
+    ensemble_size = 15
+    num_obs = 40
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    observation_values = rng.normal(size=num_obs)
+    iterations = [
+        (
+            rng.normal(size=(num_obs, ensemble_size)),
+            rng.normal(size=(num_obs, ensemble_size)),
+        )
+        for _ in range(2)
+    ]
+
+    def smoother_after_first_iteration():
+        responses, noise = iterations[0]
+        smoother = ies.SIES(ensemble_size)
+        smoother.fit(
+            responses,
+            observation_errors,
+            observation_values,
+            noise=noise,
+            inversion=inversion,
+            step_length=0.5,
+        )
+        return smoother
+
+    responses, noise = iterations[1]
+    args = (responses, observation_errors, observation_values)
+    smoother = smoother_after_first_iteration()
+    factors = smoother.factorize(*args, noise=noise, inversion=inversion)
+    for truncation in [0.5, 0.9, 1.0, 4]:
+        step_lengths = [0.2, 0.6, 1.0]
+        W_steps = factors.coefficient_matrices(truncation, step_lengths)
+        for step_length, W in zip(step_lengths, W_steps):
+            expected = smoother_after_first_iteration()
+            expected.fit(
+                *args,
+                noise=noise,
+                inversion=inversion,
+                truncation=truncation,
+                step_length=step_length,
+            )
+            assert np.allclose(W, expected.coefficient_matrix)
+            assert np.allclose(factors.coefficient_matrix(truncation, step_length), W)
+
+    smoother.fit_factorized(factors, truncation=0.9, step_length=0.6)
+    assert np.allclose(
+        smoother.coefficient_matrix, factors.coefficient_matrix(0.9, 0.6)
+    )
+
+
+@pytest.mark.parametrize(
+    "inversion", [ies.InversionType.EXACT_R, ies.InversionType.SUBSPACE_RE]
+)
+@pytest.mark.parametrize("truncation", [0.98, 0, 0.0])
+def test_that_no_significant_singular_values_keep_the_scaled_w(
+    inversion, truncation
+):
+    ensemble_size = 10
+    num_obs = 20
+    # Constant responses have no variance, so no singular value is kept
+    Y = np.zeros((num_obs, ensemble_size))
+    R = np.identity(num_obs)
+    E = rng.normal(size=(num_obs, ensemble_size))
+    D = rng.normal(size=(num_obs, ensemble_size))
+    W = rng.normal(size=(ensemble_size, ensemble_size))
+
+    W_new = create_coefficient_matrix(Y, R, E, D, inversion, truncation, W, 0.4)
+    assert np.allclose(W_new, 0.6 * W)
+
+    smoother = ies.SIES(ensemble_size)
+    factors = smoother.factorize(
+        np.ones((num_obs, ensemble_size)),
+        np.ones(num_obs),
+        np.zeros(num_obs),
+        noise=E,
+        inversion=inversion,
+    )
+    assert np.allclose(factors.coefficient_matrix(truncation, 0.4), 0.0)
+
+
+@pytest.mark.parametrize(
+    "inversion",
+    [ies.InversionType.EXACT, ies.InversionType.EXACT_R, ies.InversionType.SUBSPACE_RE],
+)
+@pytest.mark.parametrize("correlated", [False, True])
+def test_that_gpu_smoother_with_numpy_matches_sies(inversion, correlated):
+    ensemble_size = 20
+    num_obs = 30
+    num_params = 10
+    responses = rng.normal(size=(num_obs, ensemble_size))
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    if correlated:
+        A = rng.normal(size=(num_obs, num_obs))
+        observation_errors = A @ A.T / num_obs + np.diag(observation_errors)
+    observation_values = rng.normal(size=num_obs)
+    X = rng.normal(size=(num_params, ensemble_size))
+    mask = rng.random(ensemble_size) < 0.8
+
+    smoother = ies.SIES(ensemble_size)
+    smoother_gpu = gpu.SIES(ensemble_size, array_module=np)
+    for ensemble_mask in [None, mask]:
+        columns = slice(None) if ensemble_mask is None else ensemble_mask
+        noise = rng.normal(size=responses[:, columns].shape)
+        for s in [smoother, smoother_gpu]:
+            s.fit(
+                responses[:, columns],
+                observation_errors,
+                observation_values,
+                noise=noise,
+                ensemble_mask=ensemble_mask,
+                inversion=inversion,
+                param_ensemble=X[:, columns],
+            )
+        assert np.allclose(smoother_gpu.coefficient_matrix, smoother.coefficient_matrix)
+        assert np.allclose(
+            smoother_gpu.update(X[:, columns]), smoother.update(X[:, columns])
+        )
+
+
+@pytest.mark.parametrize(
+    "inversion",
+    [ies.InversionType.EXACT, ies.InversionType.EXACT_R, ies.InversionType.SUBSPACE_RE],
+)
+@pytest.mark.parametrize(
+    "make_covariance",
+    [
+        pytest.param(lambda n: ErrorCovariance.identity(n), id="identity"),
+        pytest.param(
+            lambda n: ErrorCovariance.diagonal(rng.uniform(0.5, 2.0, size=n)),
+            id="diagonal",
+        ),
+        pytest.param(
+            lambda n: ErrorCovariance.block_diagonal(
+                [np.identity(n // 2) + 0.5, 2 * np.identity(n - n // 2)]
+            ),
+            id="block_diagonal",
+        ),
+        pytest.param(lambda n: ErrorCovariance(np.identity(n) + 0.5), id="dense"),
+    ],
+)
+def test_that_gpu_smoother_with_error_covariance_matches_sies(
+    inversion, make_covariance
+):
+    ensemble_size = 20
+    num_obs = 30
+    responses = rng.normal(size=(num_obs, ensemble_size))
+    R = make_covariance(num_obs)
+    observation_values = rng.normal(size=num_obs)
+    noise = rng.normal(size=(num_obs, ensemble_size))
+    X = rng.normal(size=(10, ensemble_size))
+
+    smoother = ies.SIES(ensemble_size)
+    smoother_gpu = gpu.SIES(ensemble_size, array_module=np)
+    for s in [smoother, smoother_gpu]:
+        s.fit(responses, R, observation_values, noise=noise, inversion=inversion)
+    assert np.allclose(smoother_gpu.coefficient_matrix, smoother.coefficient_matrix)
+    assert np.allclose(smoother_gpu.update(X), smoother.update(X))
+
+
+def test_that_gpu_smoother_copies_numpy_inputs_to_cupy():
+    cupy = pytest.importorskip("cupy")
+    ensemble_size = 20
+    num_obs = 30
+    responses = rng.normal(size=(num_obs, ensemble_size))
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    observation_values = rng.normal(size=num_obs)
+    noise = rng.normal(size=(num_obs, ensemble_size))
+    X = rng.normal(size=(10, ensemble_size))
+
+    results = []
+    for smoother in [gpu.SIES(ensemble_size), gpu.SIES(ensemble_size, array_module=np)]:
+        smoother.fit(responses, observation_errors, observation_values, noise=noise)
+        results.append(smoother.update(X))
+    assert isinstance(results[0], cupy.ndarray)
+    assert np.allclose(cupy.asnumpy(results[0]), results[1])
+
+
+def test_that_gpu_smoother_rejects_low_rank_error_covariance():
+    R = ErrorCovariance.low_rank(np.ones(30), rng.normal(size=(30, 2)))
+    smoother = gpu.SIES(20, array_module=np)
+    with pytest.raises(NotImplementedError, match="Low-rank"):
+        smoother.fit(rng.normal(size=(30, 20)), R, rng.normal(size=30))
+    assert smoother.iteration_nr == 1
+
+
+@pytest.mark.parametrize(
+    "inversion", [ies.InversionType.EXACT, ies.InversionType.SUBSPACE_RE]
+)
+def test_that_native_response_projection_matches_pinv(inversion):
+    ensemble_size = 20
+    num_obs = 30
+    num_params = 5
+    X = rng.normal(size=(num_params, ensemble_size))
+    responses = np.power(X, 2)[rng.integers(num_params, size=num_obs)]
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    observation_values = rng.normal(size=num_obs)
+    noise = rng.normal(size=(num_obs, ensemble_size))
+
+    E = observation_errors[:, None] * noise
+    E -= E.mean(axis=1, keepdims=True)
+    D = (observation_values[:, None] + E - responses) / observation_errors[:, None]
+    E /= observation_errors[:, None]
+    A = (X - X.mean(axis=1, keepdims=True)) / np.sqrt(ensemble_size - 1)
+    Y = responses @ (np.linalg.pinv(A) @ A) / observation_errors[:, None]
+    Y = (Y - Y.mean(axis=1, keepdims=True)) / np.sqrt(ensemble_size - 1)
+    R = ErrorCovariance.identity(num_obs)
+
+    smoother = ies.SIES(ensemble_size)
+    W = np.zeros((ensemble_size, ensemble_size))
+    for _ in range(2):
+        smoother.fit(
+            responses,
+            observation_errors,
+            observation_values,
+            noise=noise,
+            inversion=inversion,
+            step_length=0.6,
+            param_ensemble=X,
+        )
+        W = create_coefficient_matrix(Y, R, E, D, inversion, 0.98, W, 0.6)
+        assert np.allclose(smoother.coefficient_matrix, W)
+
+    # The projection is only recomputed when the parameters change
+    state = SIESState(ensemble_size)
+    assert state.set_param_ensemble(X)
+    assert not state.set_param_ensemble(X.copy())
+    assert state.set_param_ensemble(X + 1.0)
+
+
+class ThreadComm:
+    """The point to point and broadcast operations of an MPI communicator,
+    for processes run as threads."""
+
+    def __init__(self, rank, channels):
+        self.rank = rank
+        self.channels = channels
+
+    def Get_rank(self):
+        return self.rank
+
+    def Get_size(self):
+        return len(self.channels)
+
+    def send(self, value, dest):
+        self.channels[dest][self.rank].put(value)
+
+    def recv(self, source):
+        return self.channels[self.rank][source].get(timeout=60)
+
+    def bcast(self, value, root=0):
+        if self.rank != root:
+            return self.recv(root)
+        for dest in range(self.Get_size()):
+            if dest != root:
+                self.send(value, dest)
+        return value
+
+
+@pytest.mark.parametrize(
+    "inversion, correlated",
+    [
+        (ies.InversionType.EXACT, False),
+        (ies.InversionType.EXACT_R, True),
+        (ies.InversionType.SUBSPACE_RE, False),
+    ],
+)
+def test_that_distributed_smoother_matches_sies(inversion, correlated):
+    ensemble_size = 20
+    num_params = 6
+    num_obs = 45
+    # Three processes, one with fewer observations than realizations
+    observation_rows = np.split(np.arange(num_obs), [30, 33])
+    param_rows = np.split(np.arange(num_params), [2, 3])
+
+    X = rng.normal(size=(num_params, ensemble_size))
+    responses = np.power(X, 2)[rng.integers(num_params, size=num_obs)]
+    responses += rng.normal(size=responses.shape)
+    observation_values = rng.normal(size=num_obs)
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    if correlated:
+        covariance = np.zeros((num_obs, num_obs))
+        for rows in observation_rows:
+            A = rng.normal(size=(len(rows), len(rows)))
+            covariance[np.ix_(rows, rows)] = A @ A.T / len(rows)
+        observation_errors = covariance + np.diag(observation_errors)
+    noise = rng.normal(size=(num_obs, ensemble_size))
+
+    smoother = ies.SIES(ensemble_size)
+    for _ in range(2):
+        smoother.fit(
+            responses,
+            observation_errors,
+            observation_values,
+            noise=noise,
+            inversion=inversion,
+            param_ensemble=X,
+        )
+    expected = smoother.update(X)
+
+    num_processes = len(observation_rows)
+    channels = [
+        [queue.Queue() for _ in range(num_processes)] for _ in range(num_processes)
+    ]
+
+    def process(rank):
+        rows = observation_rows[rank]
+        errors = (
+            observation_errors[np.ix_(rows, rows)]
+            if correlated
+            else observation_errors[rows]
+        )
+        local = distributed.SIES(ensemble_size, comm=ThreadComm(rank, channels))
+        for _ in range(2):
+            local.fit(
+                responses[rows],
+                errors,
+                observation_values[rows],
+                noise=noise[rows],
+                inversion=inversion,
+                param_ensemble=X[param_rows[rank]],
+            )
+        return local.coefficient_matrix, local.update(X[param_rows[rank]])
+
+    with ThreadPoolExecutor(num_processes) as executor:
+        results = list(executor.map(process, range(num_processes)))
+
+    for W, _ in results:
+        assert np.allclose(W, smoother.coefficient_matrix)
+    assert np.allclose(np.vstack([updated for _, updated in results]), expected)
+
+
+def test_that_repeated_ensemble_masks_match_sub_block_updates():
+    ensemble_size = 10
+    num_obs = 30
+    mask_a = np.ones(ensemble_size, dtype=bool)
+    mask_a[[2, 7]] = False
+    mask_b = np.ones(ensemble_size, dtype=bool)
+    mask_b[[2, 3, 9]] = False
+    full = np.ones(ensemble_size, dtype=bool)
+
+    state = SIESState(ensemble_size)
+    expected = np.zeros((ensemble_size, ensemble_size))
+    for mask in [mask_a, mask_a, mask_b, mask_b, full, mask_a]:
+        Y, E, D = (rng.normal(size=(num_obs, mask.sum())) for _ in range(3))
+        block = np.ix_(mask, mask)
+        expected[block] = create_coefficient_matrix(
+            Y, None, E, D, ies.InversionType.EXACT, 0.98, expected[block], 0.6
+        )
+        state.fit(Y, None, E, D, ies.InversionType.EXACT, 0.98, 0.6, mask)
+        transition_matrix = np.identity(mask.sum()) + expected[block] / np.sqrt(
+            mask.sum() - 1
+        )
+        assert np.allclose(state.transition_matrix(), transition_matrix)
+    assert np.allclose(state.coefficient_matrix, expected)
+
+
+@pytest.mark.parametrize(
+    "inversion",
+    [ies.InversionType.EXACT, ies.InversionType.EXACT_R, ies.InversionType.SUBSPACE_RE],
+)
+@pytest.mark.parametrize("truncation", [0.9, 4])
+def test_that_sweep_matches_fits_with_inflated_errors(inversion, truncation):
+    ensemble_size = 12
+    num_obs = 30
+    num_params = 8
+    responses = rng.normal(size=(num_obs, ensemble_size))
+    observation_errors = rng.uniform(0.5, 1.0, size=num_obs)
+    observation_values = rng.normal(size=num_obs)
+    params = rng.normal(size=(num_params, ensemble_size))
+    inflations = [1.0, 2.5, 7.0]
+    noises = [rng.normal(size=(num_obs, ensemble_size)) for _ in inflations]
+
+    for case_noises in [noises, noises[:1]]:
+        transition_matrices = ies.ES.fit_sweep(
+            responses,
+            observation_errors,
+            observation_values,
+            inflations=inflations,
+            noises=case_noises,
+            truncation=truncation,
+            inversion=inversion,
+        )
+        assert len(transition_matrices) == len(inflations)
+        for i, (inflation, T) in enumerate(zip(inflations, transition_matrices)):
+            smoother = ies.ES()
+            smoother.fit(
+                responses,
+                observation_errors * np.sqrt(inflation),
+                observation_values,
+                noise=case_noises[i % len(case_noises)],
+                truncation=truncation,
+                inversion=inversion,
+            )
+            assert np.allclose(params @ T, smoother.update(params))
+
+    # Without noise one draw is shared by all inflations
+    transition_matrices = ies.ES.fit_sweep(
+        responses, observation_errors, observation_values, inflations=[2.0, 2.0]
+    )
+    assert np.allclose(*transition_matrices)